@@ -3,6 +3,7 @@
 #include <err.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #define TRUE 1
 #define FALSE 0
@@ -52,15 +53,21 @@ void printProgress() {
 }
 
 void startProgressReport(ulong max) {
+    pthread_mutex_lock(&reportMutex);
     maxProgress = max;
     progress = 0;
     threadStatus = 1;
     pthread_cond_signal(&reportCondition);
+    pthread_mutex_unlock(&reportMutex);
 }
 
 void stopProgressReport() {
+    pthread_mutex_lock(&reportMutex);
     threadStatus = 0;
+    // Wakes the reporter up, so that the program does not wait out its refresh interval when it ends
+    pthread_cond_signal(&reportCondition);
     printProgress();
+    pthread_mutex_unlock(&reportMutex);
 }
 
 void registerProgress() {
@@ -229,6 +236,16 @@ void decomp(ulong *primes, size_t primeCount, size_t tableSize, const char* path
 }
 
 
+/** Waits a second before the next print, or less if the report is stopped meanwhile.
+ *  Called with the report mutex held, which is released while waiting.
+ */
+static void waitForRefresh() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&reportCondition, &reportMutex, &deadline);
+}
+
 void *reportProgress(void *ptr) {
     pthread_mutex_lock(&reportMutex);
     while(threadStatus != 2) {
@@ -236,7 +253,7 @@ void *reportProgress(void *ptr) {
         while (threadStatus == 1) {
             printProgress();
             iterCount = 0;
-            sleep(1);
+            waitForRefresh();
         }
     }
     pthread_mutex_unlock(&reportMutex);
@@ -270,8 +287,10 @@ int main(int argc, char **argv) {
     printf("\n");
 
     free(primes);
+    pthread_mutex_lock(&reportMutex);
     threadStatus = 2;
     pthread_cond_broadcast(&reportCondition);
+    pthread_mutex_unlock(&reportMutex);
     pthread_join(reportThread, NULL);
     pthread_mutex_destroy(&reportMutex);
     pthread_cond_destroy(&reportCondition);
@@ -0,0 +1,43 @@
+// Runs a command and writes its peak resident set size in KiB to a file.
+// A child starts from the peak RSS of the process that forks it, so the benchmark driver cannot measure the engines
+// itself: every one of them would weigh at least as much as the Python interpreter. This wrapper is small enough
+// that its share is negligible.
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s RSS_FILE COMMAND [ARGUMENT...]\n", argv[0]);
+        return 2;
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 2;
+    }
+    if (child == 0) {
+        execv(argv[2], argv + 2);
+        perror(argv[2]);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return 2;
+    }
+    FILE* file = fopen(argv[1], "w");
+    if (file) {
+        fprintf(file, "%ld\n", usage.ru_maxrss);
+        fclose(file);
+    }
+    // Die the same way, so that the driver sees what happened to the engine
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+}
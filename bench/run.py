@@ -0,0 +1,305 @@
+#!/usr/bin/env python3
+"""Benchmarks the decomp implementations over a matrix of limits and thread counts.
+
+Each run happens in a fresh directory, so that no prime cache carries over from one run to the next.
+After warmup runs, every engine is timed over repeated trials. The report gives the median and p95 wall time,
+the throughput, the peak RSS and the size of the output. The outputs of all engines for the same limit must
+hold the same decompositions. The results are written as JSON, and `run.py compare OLD NEW` compares two of
+these files, from different commits for instance.
+
+Only the standard library is used. Build the engines first with `make` in this directory.
+"""
+import argparse
+import datetime
+import hashlib
+import json
+import math
+import os
+import platform
+import shutil
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+BIN_DIR = os.path.join(BENCH_DIR, "bin")
+RESULTS_DIR = os.path.join(BENCH_DIR, "results")
+# Forks and waits for each engine, see measure.c
+MEASURE = os.path.join(BIN_DIR, "measure")
+
+# Name -> binary, whether it takes a thread count, extra arguments
+ENGINES = {
+    "basic": ("basic", False, []),
+    "dirty-array": ("dirty-array", False, []),
+    "threaded": ("threaded", True, []),
+    "memory-efficient": ("memory-efficient", True, ["--headless"]),
+    "memory-efficient-inverse": ("memory-efficient", True, ["--inverse", "--headless"]),
+    "memory-efficient-spf": ("memory-efficient", True, ["--spf", "--headless"]),
+    "memory-efficient-block": ("memory-efficient", True, ["--block", "--headless"]),
+}
+
+
+def parse_number(text):
+    """Reads 100000 as well as 1e5."""
+    return int(float(text)) if "e" in text.lower() else int(text)
+
+
+def command(engine, limit, threads):
+    binary, threaded, extra = ENGINES[engine]
+    args = [os.path.join(BIN_DIR, binary), str(limit)]
+    if threaded:
+        args.append(str(threads))
+    return args + extra
+
+
+def output_digest(path):
+    """Digest of the decompositions in an output file, in order.
+
+    memory-efficient leaves out 0, 1 and the primes, which the other engines write as "n = n" or without a
+    decomposition at all. So only the lines of composite numbers are hashed.
+    """
+    digest = hashlib.blake2b(digest_size=8)
+    count = 0
+    with open(path, "rb") as file:
+        for line in file:
+            left, sep, right = line.strip().partition(b" = ")
+            if not sep or left == right:
+                continue
+            digest.update(line.strip() + b"\n")
+            count += 1
+    return "%d:%s" % (count, digest.hexdigest())
+
+
+def kill_group(pgid):
+    try:
+        os.killpg(pgid, signal.SIGKILL)
+    except ProcessLookupError:
+        pass
+
+
+def run_once(engine, limit, threads, timeout, check):
+    """Runs ENGINE once in a directory of its own.
+
+    @return The wall time, peak RSS, output size and digest, or the reason the run failed.
+    """
+    workdir = tempfile.mkdtemp(prefix="decomp-bench-")
+    try:
+        rss_path = os.path.join(workdir, "peak-rss")
+        start = time.perf_counter()
+        # A session of its own, so that a timeout kills the engine along with the wrapper
+        process = subprocess.Popen([MEASURE, rss_path] + command(engine, limit, threads), cwd=workdir,
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, start_new_session=True)
+        timer = threading.Timer(timeout, kill_group, [process.pid])
+        timer.start()
+        process.wait()
+        wall = time.perf_counter() - start
+        timer.cancel()
+        if process.returncode != 0:
+            reason = "timeout" if process.returncode == -signal.SIGKILL else "exit %d" % process.returncode
+            return {"status": reason}
+        with open(rss_path) as file:
+            # ru_maxrss is in KiB on Linux
+            peak_rss_kib = int(file.read())
+        output = os.path.join(workdir, "output.txt")
+        return {
+            "status": "ok",
+            "wall_s": wall,
+            "peak_rss_kib": peak_rss_kib,
+            "output_bytes": os.path.getsize(output),
+            "digest": output_digest(output) if check else None,
+        }
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+def percentile(values, q):
+    """Nearest rank, so that p95 of a handful of trials is an actual trial."""
+    ordered = sorted(values)
+    return ordered[max(0, math.ceil(q * len(ordered)) - 1)]
+
+
+def benchmark(engine, limit, threads, args):
+    for _ in range(args.warmup):
+        warmup = run_once(engine, limit, threads, args.timeout, False)
+        if warmup["status"] != "ok":
+            return {"engine": engine, "limit": limit, "threads": threads, "status": warmup["status"]}
+    runs = []
+    for trial in range(args.trials):
+        # The output is the same every time, checking the first one is enough
+        run = run_once(engine, limit, threads, args.timeout, args.check and trial == 0)
+        if run["status"] != "ok":
+            return {"engine": engine, "limit": limit, "threads": threads, "status": run["status"]}
+        runs.append(run)
+    walls = [run["wall_s"] for run in runs]
+    median = statistics.median(walls)
+    return {
+        "engine": engine,
+        "limit": limit,
+        "threads": threads,
+        "status": "ok",
+        "trials_s": walls,
+        "median_s": median,
+        "p95_s": percentile(walls, 0.95),
+        "min_s": min(walls),
+        "numbers_per_s": limit / median if median > 0 else None,
+        "peak_rss_kib": max(run["peak_rss_kib"] for run in runs),
+        "output_bytes": runs[0]["output_bytes"],
+        "digest": runs[0]["digest"],
+    }
+
+
+def git_describe():
+    try:
+        commit = subprocess.run(["git", "rev-parse", "HEAD"], cwd=BENCH_DIR, capture_output=True, text=True,
+                                check=True).stdout.strip()
+        dirty = subprocess.run(["git", "status", "--porcelain", "--untracked-files=no"], cwd=BENCH_DIR,
+                               capture_output=True, text=True, check=True).stdout.strip() != ""
+        return commit, dirty
+    except (OSError, subprocess.CalledProcessError):
+        return None, False
+
+
+def machine():
+    cpu = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as file:
+            cpu = next((line.split(":", 1)[1].strip() for line in file if line.startswith("model name")), cpu)
+    except OSError:
+        pass
+    compiler = subprocess.run(["gcc", "--version"], capture_output=True, text=True).stdout.splitlines()
+    return {
+        "cpu": cpu,
+        "cpu_count": os.cpu_count(),
+        "kernel": platform.release(),
+        "compiler": compiler[0] if compiler else None,
+    }
+
+
+def check_equivalence(results):
+    """Every engine that ran a limit must have found the same decompositions."""
+    report = []
+    for limit in sorted({result["limit"] for result in results}):
+        digests = {}
+        for result in results:
+            if result["limit"] == limit and result["status"] == "ok" and result["digest"]:
+                digests.setdefault(result["digest"], []).append("%s/%d" % (result["engine"], result["threads"]))
+        report.append({"limit": limit, "equivalent": len(digests) <= 1, "digests": digests})
+    return report
+
+
+def print_table(results):
+    print("%-26s %12s %7s %10s %10s %14s %10s %12s" %
+          ("engine", "limit", "threads", "median s", "p95 s", "numbers/s", "RSS MiB", "output MiB"))
+    for result in results:
+        if result["status"] != "ok":
+            print("%-26s %12d %7d %s" % (result["engine"], result["limit"], result["threads"], result["status"]))
+            continue
+        print("%-26s %12d %7d %10.3f %10.3f %14.0f %10.1f %12.1f" %
+              (result["engine"], result["limit"], result["threads"], result["median_s"], result["p95_s"],
+               result["numbers_per_s"], result["peak_rss_kib"] / 1024, result["output_bytes"] / 2**20))
+
+
+def run(args):
+    missing = sorted({binary for binary in [ENGINES[engine][0] for engine in args.engines] + ["measure"]
+                      if not os.access(os.path.join(BIN_DIR, binary), os.X_OK)})
+    if missing:
+        sys.exit("Missing %s in %s, run make there first." % (", ".join(missing), BIN_DIR))
+    results = []
+    # An engine that timed out on a limit is not run on the larger ones
+    given_up = set()
+    for limit in args.limits:
+        for engine in args.engines:
+            # Single threaded engines only run once per limit
+            thread_counts = args.threads if ENGINES[engine][1] else [1]
+            for threads in thread_counts:
+                if (engine, threads) in given_up:
+                    continue
+                print("%s, limit %d, %d threads..." % (engine, limit, threads), file=sys.stderr, flush=True)
+                result = benchmark(engine, limit, threads, args)
+                if result["status"] == "timeout":
+                    given_up.add((engine, threads))
+                results.append(result)
+
+    commit, dirty = git_describe()
+    document = {
+        "commit": commit,
+        "dirty": dirty,
+        "date": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec="seconds"),
+        "machine": machine(),
+        "settings": {"warmup": args.warmup, "trials": args.trials, "timeout_s": args.timeout},
+        "results": results,
+        "equivalence": check_equivalence(results) if args.check else [],
+    }
+    output = args.output
+    if output is None:
+        os.makedirs(RESULTS_DIR, exist_ok=True)
+        stamp = datetime.datetime.now(datetime.timezone.utc).strftime("%Y%m%dT%H%M%SZ")
+        output = os.path.join(RESULTS_DIR, "%s%s-%s.json" % ((commit or "unknown")[:10], "-dirty" if dirty else "",
+                                                             stamp))
+    with open(output, "w") as file:
+        json.dump(document, file, indent=2)
+        file.write("\n")
+
+    print_table(results)
+    mismatches = [entry for entry in document["equivalence"] if not entry["equivalent"]]
+    for entry in mismatches:
+        print("The outputs for limit %d differ: %s" % (entry["limit"], json.dumps(entry["digests"])))
+    print("Results written to %s" % output)
+    return 1 if mismatches else 0
+
+
+def compare(args):
+    """Prints the change of median time and peak RSS of every run the two files have in common."""
+    with open(args.old) as file:
+        old = json.load(file)
+    with open(args.new) as file:
+        new = json.load(file)
+    key = lambda result: (result["engine"], result["limit"], result["threads"])
+    before = {key(result): result for result in old["results"] if result["status"] == "ok"}
+    print("%s -> %s" % ((old["commit"] or "unknown")[:10], (new["commit"] or "unknown")[:10]))
+    print("%-26s %12s %7s %10s %10s %9s %9s" % ("engine", "limit", "threads", "old s", "new s", "speedup", "RSS"))
+    for result in new["results"]:
+        previous = before.get(key(result))
+        if result["status"] != "ok" or previous is None:
+            continue
+        print("%-26s %12d %7d %10.3f %10.3f %8.2fx %+8.1f%%" %
+              (result["engine"], result["limit"], result["threads"], previous["median_s"], result["median_s"],
+               previous["median_s"] / result["median_s"],
+               (result["peak_rss_kib"] / previous["peak_rss_kib"] - 1) * 100))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    subparsers = parser.add_subparsers(dest="command")
+    comparison = subparsers.add_parser("compare", help="compare two result files")
+    comparison.add_argument("old")
+    comparison.add_argument("new")
+    parser.add_argument("--limits", default="1e5,1e6,1e7", help="comma separated, up to 1e9 (default: %(default)s)")
+    parser.add_argument("--threads", default="1,%d" % (os.cpu_count() or 1),
+                        help="comma separated thread counts (default: %(default)s)")
+    parser.add_argument("--engines", default=",".join(ENGINES), help="comma separated (default: all)")
+    parser.add_argument("--warmup", type=int, default=1, help="untimed runs before the trials (default: %(default)s)")
+    parser.add_argument("--trials", type=int, default=5, help="timed runs (default: %(default)s)")
+    parser.add_argument("--timeout", type=float, default=600,
+                        help="seconds before a run is killed, and the larger limits skipped (default: %(default)s)")
+    parser.add_argument("--no-check", dest="check", action="store_false", help="skip the output equivalence check")
+    parser.add_argument("--output", help="results file (default: results/<commit>-<date>.json)")
+    args = parser.parse_args()
+    if args.command == "compare":
+        return compare(args)
+    args.limits = [parse_number(limit) for limit in args.limits.split(",")]
+    args.threads = sorted({parse_number(threads) for threads in args.threads.split(",")})
+    args.engines = args.engines.split(",")
+    unknown = [engine for engine in args.engines if engine not in ENGINES]
+    if unknown:
+        parser.error("unknown engines %s, choose among %s" % (", ".join(unknown), ", ".join(ENGINES)))
+    return run(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -3,6 +3,7 @@
 #include <err.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #define TRUE 1
 #define FALSE 0
@@ -51,15 +52,21 @@ void printProgress() {
 }
 
 void startProgressReport(ulong max) {
+    pthread_mutex_lock(&reportMutex);
     maxProgress = max;
     progress = 0;
     threadStatus = 1;
     pthread_cond_signal(&reportCondition);
+    pthread_mutex_unlock(&reportMutex);
 }
 
 void stopProgressReport() {
+    pthread_mutex_lock(&reportMutex);
     threadStatus = 0;
+    // Wakes the reporter up, so that the program does not wait out its refresh interval when it ends
+    pthread_cond_signal(&reportCondition);
     printProgress();
+    pthread_mutex_unlock(&reportMutex);
 }
 
 void registerProgress() {
@@ -181,7 +188,11 @@ ulong decomposeNumber(const ulong *primes, ulong *factors, size_t primeCount, ul
     }
     if (number > 1) {
         ulong index = indexOfPrime(primes, primeCount, number);
-        if (index != -1) {
+        if (index == j) {
+            // What remains is the prime that was just divided out, as in 4 = 2^2
+            factors[index]++;
+            greatestFactorIndex = index;
+        } else if (index != -1) {
             for (size_t i = j + 1; i < index; i++) {
                 factors[i] = 0;
             }
@@ -233,6 +244,16 @@ void decomp(ulong *primes, size_t primeCount, size_t tableSize, const char* path
 }
 
 
+/** Waits a second before the next print, or less if the report is stopped meanwhile.
+ *  Called with the report mutex held, which is released while waiting.
+ */
+static void waitForRefresh() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&reportCondition, &reportMutex, &deadline);
+}
+
 void *reportProgress(void *ptr) {
     pthread_mutex_lock(&reportMutex);
     while(threadStatus != 2) {
@@ -240,7 +261,7 @@ void *reportProgress(void *ptr) {
         while (threadStatus == 1) {
             printProgress();
             iterCount = 0;
-            sleep(1);
+            waitForRefresh();
         }
     }
     pthread_mutex_unlock(&reportMutex);
@@ -274,8 +295,10 @@ int main(int argc, char **argv) {
     printf("\n");
 
     free(primes);
+    pthread_mutex_lock(&reportMutex);
     threadStatus = 2;
     pthread_cond_broadcast(&reportCondition);
+    pthread_mutex_unlock(&reportMutex);
     pthread_join(reportThread, NULL);
     pthread_mutex_destroy(&reportMutex);
     pthread_cond_destroy(&reportCondition);
@@ -0,0 +1,23 @@
+#pragma once
+#include "defines.h"
+
+// Consecutive numbers factored together in one block.
+#define BLOCK_SIEVE_SIZE (1 << 14)
+#define BLOCK_MAX_FACTORS MAX_DISTINCT_FACTORS
+
+typedef struct {
+    ulong first;
+    ulong length;
+    ulong* cofactors;
+    uint* factors;
+    uchar* exponents;
+    uchar* factorCounts;
+} FactorBlock;
+
+void factorBlockInit(FactorBlock* block);
+
+void factorBlockDestroy(FactorBlock* block);
+
+void factorBlockSieve(FactorBlock* block, const ulong* darrayBasePrimes, ulong first, ulong length);
+
+void factorBlockGet(const FactorBlock* block, ulong index, ulong** darrayFactorsP, ulong** darrayFactorCountsP);
@@ -0,0 +1,61 @@
+#pragma once
+#include "defines.h"
+
+#define CHECKPOINT_MAGIC "DCMPCKP3"
+// Seconds between two checkpoints, at most this much work is lost when the process is killed
+#define CHECKPOINT_INTERVAL 10
+
+/** Running checksum of a byte stream, fed in pieces of any size. */
+typedef struct {
+    ulong state;
+    ulong pending;      // Bytes not yet folded into the state, at most 7
+    ulong pendingCount;
+    ulong length;
+} Checksum;
+
+/** What is saved in the checkpoint file, followed by INDEXCOUNT offsets of the binary table index. */
+typedef struct {
+    char magic[8];
+    ulong first;
+    ulong limit;
+    ulong output;
+    // The prime phase needs no record, the prime cache header says how far it got.
+    // Everything below nextNumber is in the output file.
+    ulong chunkSize;
+    ulong nextChunk;
+    ulong nextNumber;
+    ulong outputStart;
+    ulong outputOffset;
+    Checksum outputChecksum;
+    ulong indexCount;
+} CheckpointRecord;
+
+typedef struct {
+    const char* path;
+    CheckpointRecord record;
+    ulong* darrayIndex;
+    ulong lastSave;
+} Checkpoint;
+
+void checksumInit(Checksum* checksum);
+
+void checksumUpdate(Checksum* checksum, const void* data, size_t length);
+
+bool checksumEqual(const Checksum* a, const Checksum* b);
+
+bool checksumFile(Checksum* checksum, int fd, ulong start, ulong end);
+
+void checkpointInit(Checkpoint* checkpoint, const char* path, ulong first, ulong limit, ulong output);
+
+bool checkpointLoad(Checkpoint* checkpoint, const char* path);
+
+void checkpointResetOutput(Checkpoint* checkpoint, ulong chunkSize, ulong outputStart);
+
+void checkpointRecordOutput(Checkpoint* checkpoint, ulong nextChunk, ulong outputOffset, const Checksum* checksum,
+                            const ulong* darrayIndex);
+
+bool checkpointDue(const Checkpoint* checkpoint);
+
+void checkpointSave(Checkpoint* checkpoint, int outputFd);
+
+void checkpointDestroy(Checkpoint* checkpoint, bool remove);
@@ -16,6 +16,8 @@ void darrayClear(void* darray);
 void _darrayAdd(void** darrayp, const void* element);
 void darrayRemove(void* darray, ulong index);
 void _darrayInsert(void** darrayp, const void* element, ulong index);
+void _darrayAppend(void** darrayp, const void* elements, ulong count);
+void _darrayResize(void** darrayp, ulong length);
 
 #define darrayAdd(darray, elem)               \
     {                                         \
@@ -23,6 +25,10 @@ void _darrayInsert(void** darrayp, const void* element, ulong index);
         _darrayAdd((void**)darray, &holder);         \
     }
 
+#define darrayAppend(darray, elements, count) _darrayAppend((void**)darray, elements, count)
+
+#define darrayResize(darray, length) _darrayResize((void**)darray, length)
+
 #define darrayInsert(darray, elem, index)           \
     {                                         \
         typeof(elem) holder = elem;                  \
@@ -1,18 +1,81 @@
 #pragma once
 #include "defines.h"
+#include "block-sieve.h"
+#include "checkpoint.h"
+#include "format.h"
+#include "inverse-table.h"
+#include "ordered-output.h"
+#include "prime-cache.h"
+#include "spf.h"
+#include "trial-kernel.h"
 
-#include <stdio.h>
+#include <stdatomic.h>
+
+// Consecutive numbers handed to a worker at once, one block for the block sieve engine
+#define DECOMP_CHUNK_SIZE BLOCK_SIEVE_SIZE
+// Chunks each worker may run ahead of the writer
+#define DECOMP_WINDOW_PER_THREAD 4
+
+typedef enum { DECOMP_TRIAL_DIVISION = 0, DECOMP_TRIAL_INVERSE, DECOMP_SPF_TABLE, DECOMP_BLOCK_SIEVE } DecompEngine;
+
+typedef enum { DECOMP_OUTPUT_TEXT = 0, DECOMP_OUTPUT_BINARY } DecompOutput;
+
+/** Receives every decomposition of a run, called from each worker thread with the context of that thread,
+ *  so that it can reduce without locks. Within a chunk the numbers come in increasing order,
+ *  the chunks themselves in any order. Prime numbers come with no factors.
+ */
+typedef struct {
+    // Nonzero stops the run, every worker then drops the queue after its current chunk
+    int (*consume)(void* context, ulong number, const ulong* factors, const ulong* factorCounts, ulong factorCount);
+    // Called around each chunk of DECOMP_CHUNK_SIZE numbers a worker takes, may be NULL
+    void (*beginChunk)(void* context, ulong sequence);
+    void (*endChunk)(void* context, ulong sequence);
+    // One per worker thread, or NULL
+    void** threadContexts;
+} DecompConsumer;
 
 typedef struct {
     ulong firstNumber;
     ulong lastNumber;
-    FILE* primeListFile;
+    ulong chunkCount;
+    // Every prime up to the square root of the table, for trial division
+    const ulong* primes;
     size_t primeCount;
-    size_t tableSize;
-    FILE* outputFile;
+    const PrimeInverse* inverses;
+    size_t inverseCount;
+    const TrialKernelTable* kernelTable;
     ulong threadId;
+    DecompEngine engine;
+    const SpfTable* spfTable;
+    const ulong* darrayBasePrimes;
+    const DecompConsumer* consumer;
+    void* consumerContext;
+    // The chunk queue of the run and the value it was stopped with, shared by every worker
+    atomic_ulong* nextChunk;
+    atomic_int* stopValue;
 } DecompData;
 
-void launchDecomposition(const char* primeListPath, size_t primeCount, size_t tableSize, const char *filePath, size_t threadCount);
+/** A decomposition run: the numbers of [firstNumber, lastNumber) and where their decompositions go. */
+typedef struct {
+    ulong firstNumber;
+    ulong lastNumber;
+    // Must cover the square root of lastNumber, or every number of the window for binary output
+    const char* primeListPath;
+    const char* inverseListPath;
+    const char* outputPath;
+    // Bytes left to the caller at the start of the output file, for a header of its own
+    ulong outputBase;
+    size_t threadCount;
+    DecompEngine engine;
+    DecompOutput output;
+    // Resumed from and saved regularly when not NULL
+    Checkpoint* checkpoint;
+    // Primes up to the square root of lastNumber for the block sieve, sieved for the run when NULL
+    const ulong* darrayBasePrimes;
+    // Takes the place of the output file when not NULL, output, outputPath and checkpoint are then unused
+    const DecompConsumer* consumer;
+} DecompSettings;
+
+int launchDecomposition(const DecompSettings* settings);
 
-void* decompose(void* input);
+ulong trialDecompose(const ulong* primes, ulong primeCount, ulong number, ulong* factors, ulong* factorCounts);
@@ -3,7 +3,13 @@
 #define TRUE 1
 #define FALSE 0
 #define ISQRT_STEPS 100
+// No number below 2^64 has more distinct prime factors than this.
+#define MAX_DISTINCT_FACTORS 15
+// Counters written by different threads sit this far apart, so that they never share a cache line.
+#define CACHE_LINE_SIZE 64
 
 typedef unsigned long ulong;
 typedef unsigned int uint;
+typedef unsigned short ushort;
 typedef unsigned char bool;
+typedef unsigned char uchar;
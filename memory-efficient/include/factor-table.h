@@ -0,0 +1,43 @@
+#pragma once
+#include "defines.h"
+#include "format.h"
+#include "prime-cache.h"
+
+#define FACTOR_TABLE_MAGIC "DCMPTAB1"
+// Numbers between two entries of the offset index, must divide DECOMP_CHUNK_SIZE
+#define FACTOR_TABLE_INDEX_INTERVAL 256
+// Longest record: the factor count, then a prime index and an exponent per factor, all varints
+#define FACTOR_TABLE_RECORD_MAX (10 + MAX_DISTINCT_FACTORS * 20)
+
+typedef struct {
+    char magic[8];
+    ulong firstNumber;
+    ulong lastNumber;
+    ulong indexInterval;
+    ulong indexOffset;
+} FactorTableHeader;
+
+typedef struct {
+    int fd;
+    const uchar* mapping;
+    size_t mappingSize;
+    const FactorTableHeader* header;
+    const ulong* index;
+    PrimeCache primeCache;
+} FactorTable;
+
+void factorTableWriteHeader(int fd, ulong base, ulong firstNumber, ulong lastNumber);
+
+void factorTableWriteIndex(int fd, ulong base, ulong firstNumber, ulong lastNumber, const ulong* darrayIndex);
+
+void factorTableSetIndex(int fd, ulong base, ulong firstNumber, ulong lastNumber, ulong indexOffset);
+
+void factorTableEncode(OutputBuffer* buffer, const PrimeLookup* primeLookup, const ulong* factors,
+                       const ulong* factorCounts, ulong factorCount);
+
+bool factorTableOpen(FactorTable* table, const char* path, const char* primeListPath);
+
+void factorTableClose(FactorTable* table);
+
+bool factorTableLookup(const FactorTable* table, ulong number, ulong* factors, ulong* factorCounts,
+                       ulong* outFactorCount);
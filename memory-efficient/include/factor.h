@@ -0,0 +1,7 @@
+#pragma once
+#include "defines.h"
+
+// Below this bound, factors are found by trial division before Pollard's rho takes over.
+#define FACTOR_TRIAL_LIMIT 1024
+
+ulong factorNumber(ulong number, ulong* factors, ulong* factorCounts);
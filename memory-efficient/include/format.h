@@ -0,0 +1,25 @@
+#pragma once
+#include "defines.h"
+
+// Longest possible line: a 20-digit number and 15 factors of the form " * p^e"
+#define FORMAT_LINE_MAX 1024
+
+typedef struct {
+    int fd;
+    char* data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+void outputBufferInit(OutputBuffer* buffer, int fd, size_t capacity);
+
+void outputBufferDestroy(OutputBuffer* buffer);
+
+void outputBufferReserve(OutputBuffer* buffer, size_t size);
+
+void outputBufferFlush(OutputBuffer* buffer);
+
+char* formatUnsigned(char* out, ulong value);
+
+void formatFactorLine(OutputBuffer* buffer, ulong number, const ulong* factors, const ulong* factorCounts,
+                      ulong factorCount);
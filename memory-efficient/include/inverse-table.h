@@ -0,0 +1,32 @@
+#pragma once
+#include "defines.h"
+#include "prime-cache.h"
+
+// Extension of the prime cache written next to primes.bin
+#define INVERSE_TABLE_EXTENSION "inv"
+
+/** Divisibility constants of one prime.
+ *  For an odd prime p, n is a multiple of p exactly when n * inverse <= limit (modulo 2^64),
+ *  and the product is then the quotient n / p.
+ */
+typedef struct {
+    ulong prime;
+    ulong inverse;
+    ulong limit;
+} PrimeInverse;
+
+typedef struct {
+    int fd;
+    void* mapping;
+    size_t mappingSize;
+    ulong count;
+    const PrimeInverse* entries;
+} InverseTable;
+
+void primeInverseCompute(ulong prime, PrimeInverse* entry);
+
+bool inverseTableWrite(const char* path, const PrimeCache* primeCache);
+
+bool inverseTableOpen(InverseTable* table, const char* path);
+
+void inverseTableClose(InverseTable* table);
@@ -0,0 +1,76 @@
+#pragma once
+/** libdecomp, the prime sieve and decomposition engines of decomp as a library.
+ *  This header only depends on the C standard library and stays source and binary compatible
+ *  for as long as DECOMP_API_VERSION does not change.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DECOMP_API_VERSION 1
+// No number below 2^64 has more distinct prime factors, output buffers of this size always suffice
+#define DECOMP_MAX_FACTORS 15
+
+#if defined(__GNUC__)
+#define DECOMP_EXPORT __attribute__((visibility("default")))
+#else
+#define DECOMP_EXPORT
+#endif
+
+/** Holds the prime table, shared read-only by every call made with it, from any thread. */
+typedef struct decomp_ctx decomp_ctx;
+
+/** Receives each number of a range with its prime factors in increasing order and their exponents.
+ *  Prime numbers come with themselves as their only factor, 0 and 1 with none.
+ *  @return 0 to go on, anything else to stop the range there.
+ */
+typedef int (*decomp_factor_callback)(uint64_t n, const uint64_t* factors, const uint32_t* exps, size_t count,
+                                      void* user);
+
+/** Loads every prime below PRIME_LIMIT.
+ *  They are read from the prime cache at CACHE_PATH if it covers them, otherwise sieved with THREAD_COUNT threads
+ *  and saved there when possible. CACHE_PATH may be NULL to stay in memory.
+ *  @return NULL if the context could not be allocated.
+ */
+DECOMP_EXPORT decomp_ctx* decomp_create(uint64_t prime_limit, const char* cache_path, unsigned thread_count);
+
+DECOMP_EXPORT void decomp_destroy(decomp_ctx* ctx);
+
+/** Every prime below this limit is in the table of CTX. */
+DECOMP_EXPORT uint64_t decomp_prime_limit(const decomp_ctx* ctx);
+
+/** Decomposes N into OUT_FACTORS and OUT_EXPS, which need DECOMP_MAX_FACTORS entries each.
+ *  Nothing is allocated. Any N works, the table only makes the numbers below the square of its limit faster.
+ *  @return The number of distinct prime factors, 0 for 0 and 1.
+ */
+DECOMP_EXPORT size_t decomp_factor(const decomp_ctx* ctx, uint64_t n, uint64_t* out_factors, uint32_t* out_exps);
+
+/** Writes the primes of [LOW, HIGH) to OUT in increasing order, at most CAPACITY of them.
+ *  @return How many primes the range holds, which may be more than were written.
+ */
+DECOMP_EXPORT uint64_t decomp_primes_range(const decomp_ctx* ctx, uint64_t low, uint64_t high, uint64_t* out,
+                                           size_t capacity);
+
+/** Calls CALLBACK with the decomposition of every number of [FIRST, LAST), in increasing order.
+ *  @return 0 once the whole range went through, or whatever nonzero value CALLBACK stopped it with.
+ */
+DECOMP_EXPORT int decomp_factor_range(const decomp_ctx* ctx, uint64_t first, uint64_t last,
+                                      decomp_factor_callback callback, void* user);
+
+/** Same as decomp_factor_range, with THREAD_COUNT worker threads calling CALLBACK at once.
+ *  Worker i always passes THREAD_USERS[i], so that each can reduce into its own state without locks.
+ *  Each worker sees runs of consecutive numbers in increasing order, but the runs come in no particular order.
+ *  Nothing is formatted or written, the decompositions only exist for the duration of the call.
+ *  @param thread_users THREAD_COUNT pointers, or NULL
+ *  @return 0 once the whole range went through, or the first nonzero value CALLBACK returned,
+ *  after which the workers stop at the end of their current run.
+ */
+DECOMP_EXPORT int decomp_factor_stream(const decomp_ctx* ctx, uint64_t first, uint64_t last,
+                                       decomp_factor_callback callback, void** thread_users, unsigned thread_count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+#include "defines.h"
+
+// Montgomery arithmetic modulo an odd 64-bit number, with R = 2^64.
+// The functions are inline because they sit in the innermost loops of primality testing and factoring.
+
+typedef unsigned __int128 u128;
+
+typedef struct {
+    ulong modulus;
+    ulong inverse; // modulus^-1 mod 2^64
+    ulong r2;      // R^2 mod modulus
+    ulong one;     // R mod modulus, 1 in Montgomery form
+} Montgomery;
+
+static inline void montgomeryInit(Montgomery* m, ulong modulus) {
+    // Each Newton step doubles the number of correct low bits, modulus is its own inverse mod 8
+    ulong inverse = modulus;
+    for (uint i = 0; i < 5; i++) {
+        inverse *= 2 - modulus * inverse;
+    }
+    m->modulus = modulus;
+    m->inverse = inverse;
+    m->one = (0 - modulus) % modulus;
+    m->r2 = (ulong)(((u128)m->one * m->one) % modulus);
+}
+
+/** Computes T / R mod modulus, for any T below modulus * R. */
+static inline ulong montgomeryReduce(const Montgomery* m, u128 t) {
+    ulong low = (ulong)t;
+    ulong high = (ulong)(t >> 64);
+    ulong q = low * m->inverse;
+    ulong qnHigh = (ulong)(((u128)q * m->modulus) >> 64);
+    return high < qnHigh ? high - qnHigh + m->modulus : high - qnHigh;
+}
+
+static inline ulong montgomeryMultiply(const Montgomery* m, ulong a, ulong b) {
+    return montgomeryReduce(m, (u128)a * b);
+}
+
+static inline ulong montgomeryFrom(const Montgomery* m, ulong x) {
+    return montgomeryMultiply(m, x % m->modulus, m->r2);
+}
+
+static inline ulong montgomeryTo(const Montgomery* m, ulong x) {
+    return montgomeryReduce(m, x);
+}
+
+static inline ulong montgomeryAdd(const Montgomery* m, ulong a, ulong b) {
+    ulong sum = a + b;
+    return sum < a || sum >= m->modulus ? sum - m->modulus : sum;
+}
+
+static inline ulong montgomerySubtract(const Montgomery* m, ulong a, ulong b) {
+    return a >= b ? a - b : a - b + m->modulus;
+}
+
+static inline ulong montgomeryPower(const Montgomery* m, ulong base, ulong exp) {
+    ulong result = m->one;
+    while (exp > 0) {
+        if (exp & 1)
+            result = montgomeryMultiply(m, result, base);
+        exp >>= 1;
+        base = montgomeryMultiply(m, base, base);
+    }
+    return result;
+}
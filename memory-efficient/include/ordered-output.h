@@ -0,0 +1,39 @@
+#pragma once
+#include "defines.h"
+#include "checkpoint.h"
+#include "format.h"
+
+#include <pthread.h>
+
+typedef struct {
+    OutputBuffer buffer;
+    // Positions in the buffer the writer should report as file offsets, NULL if unused
+    ulong* darrayMarks;
+    bool ready;
+} OutputChunk;
+
+typedef struct {
+    int fd;
+    ulong chunkCount;
+    ulong windowSize;
+    OutputChunk* slots;
+    ulong nextToWrite;
+    ulong bytesWritten;
+    ulong* darrayOffsets;
+    Checksum checksum;
+    // Saved as chunks get written, NULL if unused
+    Checkpoint* checkpoint;
+    pthread_mutex_t mutex;
+    pthread_cond_t chunkReady;
+    pthread_cond_t slotFree;
+    pthread_t writerThread;
+} OrderedWriter;
+
+void orderedWriterStart(OrderedWriter* writer, int fd, ulong firstSequence, ulong chunkCount, ulong windowSize,
+                        Checkpoint* checkpoint);
+
+void orderedWriterFinish(OrderedWriter* writer);
+
+OutputChunk* orderedWriterAcquire(OrderedWriter* writer, ulong sequence);
+
+void orderedWriterSubmit(OrderedWriter* writer, ulong sequence);
@@ -0,0 +1,36 @@
+#pragma once
+#include "defines.h"
+#include "stats.h"
+
+#include <stdio.h>
+
+typedef enum {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    // Software events, available even where the hardware is not exposed
+    PERF_TASK_CLOCK,
+    PERF_PAGE_FAULTS,
+    PERF_EVENT_COUNT
+} PerfEvent;
+
+/** The counters one thread has open for the phase it is in, -1 for those the kernel refused. */
+typedef struct {
+    int fds[PERF_EVENT_COUNT];
+} PerfCounters;
+
+// Set by perfInit, every other call does nothing otherwise
+extern bool perfEnabled;
+
+void perfInit(ulong workerCount);
+
+void perfShutdown();
+
+void perfBegin(PerfCounters* counters);
+
+void perfEnd(PerfCounters* counters, ulong threadId, StatsPhase phase);
+
+void perfPrint(FILE* file);
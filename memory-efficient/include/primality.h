@@ -0,0 +1,4 @@
+#pragma once
+#include "defines.h"
+
+bool isPrime(ulong number);
@@ -0,0 +1,113 @@
+#pragma once
+#include "defines.h"
+
+#define PRIME_CACHE_MAGIC "DCMPPRIM"
+// Version 1 stores raw ulongs, version 2 the gaps between primes
+#define PRIME_CACHE_VERSION_RAW 1
+#define PRIME_CACHE_VERSION_GAPS 2
+// Primes between two absolute checkpoints of a gap-compressed cache
+#define PRIME_CACHE_BLOCK_SIZE 1024
+// Primes between two checkpoints of a PrimeLookup, in memory only
+#define PRIME_LOOKUP_STRIDE 16
+
+/** Start of primes.bin.
+ *  Version 1 is followed by the primes as raw ulongs.
+ *  Version 2 is followed by the gap of every prime to the previous one, one byte holding half the gap,
+ *  or a zero byte and a varint of the whole gap when it does not fit (and for the odd gap from 2 to 3).
+ *  The block index at indexOffset gives the first prime of every block and where the gaps after it start.
+ */
+typedef struct {
+    char magic[8];
+    ulong version;
+    // Every prime below this limit is in the file
+    ulong limit;
+    ulong primeCount;
+    ulong blockSize;
+    ulong indexOffset;
+} PrimeCacheHeader;
+
+typedef struct {
+    ulong firstPrime;
+    ulong offset;
+} PrimeCacheBlock;
+
+typedef struct {
+    int fd;
+    void* mapping;
+    size_t mappingSize;
+    ulong version;
+    ulong limit;
+    ulong primeCount;
+    // Raw caches only
+    const ulong* primes;
+    // Gap-compressed caches only
+    const uchar* gaps;
+    const PrimeCacheBlock* blocks;
+    ulong blockCount;
+} PrimeCache;
+
+/** Walks the cache in order, UPCOMING is the prime the next step yields. */
+typedef struct {
+    const PrimeCache* cache;
+    ulong index;
+    ulong prime;
+    ulong upcoming;
+    const uchar* next;
+} PrimeIterator;
+
+/** Finds the index of many primes below a limit, which primeCacheIndexOf does by walking up to a whole block.
+ *  Raw caches need no checkpoints, their lookups are a binary search already.
+ */
+typedef struct {
+    const PrimeCache* cache;
+    // Every PRIME_LOOKUP_STRIDE-th prime and where the gaps after it start, NULL for raw caches
+    PrimeCacheBlock* darrayCheckpoints;
+} PrimeLookup;
+
+bool primeCacheOpen(PrimeCache* cache, const char* path);
+
+void primeCacheClose(PrimeCache* cache);
+
+bool primeCacheStore(const char* path, const PrimeCache* base, ulong limit, const ulong* primes, ulong primeCount);
+
+ulong primeCacheGet(const PrimeCache* cache, ulong index);
+
+ulong primeCacheIndexOf(const PrimeCache* cache, ulong prime);
+
+ulong* primeCacheDecode(const PrimeCache* cache, ulong limit);
+
+void primeIteratorSeek(PrimeIterator* iterator, const PrimeCache* cache, ulong index);
+
+void primeLookupInit(PrimeLookup* lookup, const PrimeCache* cache, ulong limit);
+
+void primeLookupDestroy(PrimeLookup* lookup);
+
+ulong primeLookupIndexOf(const PrimeLookup* lookup, ulong prime);
+
+ulong primeCacheDecodeLongGap(const uchar** in);
+
+/** Moves to the next prime of the cache, found in ITERATOR->prime.
+ *  Inline, as it is called once per prime when walking the whole cache.
+ *  @return FALSE once every prime has been seen.
+ */
+static inline bool primeIteratorNext(PrimeIterator* iterator) {
+    const PrimeCache* cache = iterator->cache;
+    if (iterator->index >= cache->primeCount)
+        return FALSE;
+    iterator->prime = iterator->upcoming;
+    iterator->index++;
+    if (iterator->index < cache->primeCount) {
+        if (cache->primes) {
+            iterator->upcoming = cache->primes[iterator->index];
+        } else {
+            uchar halfGap = *iterator->next;
+            if (halfGap) {
+                iterator->next++;
+                iterator->upcoming += 2 * (ulong)halfGap;
+            } else {
+                iterator->upcoming += primeCacheDecodeLongGap(&iterator->next);
+            }
+        }
+    }
+    return TRUE;
+}
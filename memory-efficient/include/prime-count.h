@@ -7,3 +7,5 @@ ulong naturalLog(ulong x);
 ulong integralLog(ulong x);
 
 ulong approxPrimeCount(ulong limit);
+
+ulong exactPrimeCount(ulong x);
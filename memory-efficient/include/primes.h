@@ -1,4 +1,4 @@
 #pragma once
 #include "defines.h"
 
-void findPrimes(ulong **darrayPrimesP, size_t limit, size_t threadCount);
+void findPrimes(ulong **darrayPrimesP, size_t low, size_t limit, size_t threadCount);
@@ -4,11 +4,23 @@
 
 #include <stdio.h>
 
-void startProgressReport(ulong max);
+/** How the progress of each phase is shown, besides the SIGUSR1 dump to stderr. */
+typedef struct {
+    // No progress bars, only a plain line at the end of each phase
+    bool headless;
+    // Rewritten with the metrics in the Prometheus text format at every refresh, or NULL
+    const char* metricsPath;
+} ProgressSettings;
+
+void startProgressReport(const char* phase, ulong max);
 
 void stopProgressReport();
 
+/** Counts one unit of work of THREADID, published to the reporter in batches. */
 void registerProgress(ulong threadId);
 
-void initProgressReporter(size_t threadCount);
+/** Counts AMOUNT units of work of THREADID at once, published right away. */
+void registerProgressAmount(ulong threadId, ulong amount);
+
+void initProgressReporter(size_t threadCount, const ProgressSettings* settings);
 void shutdownProgressReporter();
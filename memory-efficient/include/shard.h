@@ -0,0 +1,32 @@
+#pragma once
+#include "defines.h"
+#include "checkpoint.h"
+
+#define SHARD_MAGIC "DCMPSHD2"
+#define SHARD_EXTENSION "shard"
+
+/** Header of a shard file, followed by the output of its window exactly as a single run would write it. */
+typedef struct {
+    char magic[8];
+    // The window of this shard, a slice of [jobFirst, jobLast)
+    ulong firstNumber;
+    ulong lastNumber;
+    ulong jobFirst;
+    ulong jobLast;
+    ulong shardCount;
+    ulong shardIndex;
+    ulong output;
+    // FALSE until the shard is complete, the payload of an empty slice is empty too
+    ulong sealed;
+    ulong payloadSize;
+    Checksum payloadChecksum;
+} ShardHeader;
+
+void shardRange(ShardHeader* header, ulong jobFirst, ulong jobLast, ulong shardCount, ulong shardIndex,
+                ulong output);
+
+bool shardBegin(const char* path, const ShardHeader* header);
+
+bool shardSeal(const char* path, ShardHeader* header);
+
+bool shardMerge(const char* outputPath, char** shardPaths, ulong shardCount);
@@ -0,0 +1,15 @@
+#pragma once
+#include "defines.h"
+
+// Size in bytes of one sieve segment. The sieve only stores odd numbers,
+// one byte each, so a segment covers twice as many integers.
+#define SIEVE_SEGMENT_SIZE (1 << 15)
+#define SIEVE_SEGMENT_SPAN (2 * (ulong)SIEVE_SEGMENT_SIZE)
+
+ulong integerSqrt(ulong num);
+
+ulong* sieveBasePrimes(ulong limit);
+
+void sieveSegment(const ulong* darrayBasePrimes, ulong low, ulong high, bool* segment, ulong** darrayPrimesP);
+
+void sieveRange(const ulong* darrayBasePrimes, ulong low, ulong high, ulong** darrayPrimesP);
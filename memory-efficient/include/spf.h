@@ -0,0 +1,19 @@
+#pragma once
+#include "defines.h"
+
+// Entries of the table per segment while it is being built (128 KiB, sized for L2).
+#define SPF_SEGMENT_ENTRIES (1 << 16)
+
+typedef struct {
+    ulong limit;
+    // entries[m / 2] holds, for each odd m < limit, the index in darrayBasePrimes
+    // of its smallest prime factor, or 0 when m is prime.
+    ushort* entries;
+    ulong* darrayBasePrimes;
+} SpfTable;
+
+void spfTableBuild(SpfTable* table, ulong limit, size_t threadCount);
+
+void spfTableDestroy(SpfTable* table);
+
+void spfDecompose(const SpfTable* table, ulong number, ulong** darrayFactorsP, ulong** darrayFactorCountsP);
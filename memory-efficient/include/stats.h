@@ -0,0 +1,80 @@
+#pragma once
+#include "defines.h"
+
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+typedef enum {
+    STATS_SIEVE = 0,
+    STATS_SPF_TABLE,
+    STATS_CACHE_WRITE,
+    STATS_FACTORIZE,
+    // Formatting, or whatever else the consumer of the decompositions does
+    STATS_FORMAT,
+    STATS_IO,
+    STATS_PHASE_COUNT
+} StatsPhase;
+
+// Bucket i counts the numbers whose factorization took [2^i, 2^(i+1)) cycles
+#define STATS_BUCKET_COUNT 64
+// The threads that are not workers have slots of their own
+#define STATS_MAIN_THREAD ((ulong)-1)
+#define STATS_WRITER_THREAD ((ulong)-2)
+
+/** What one thread measured, on cache lines of its own, so that recording never contends. */
+typedef struct {
+    ulong cycles[STATS_PHASE_COUNT];
+    // Only measured around coarse work, the rest is derived from the cycles
+    ulong nanoseconds[STATS_PHASE_COUNT];
+    ulong units[STATS_PHASE_COUNT];
+    ulong histogram[STATS_BUCKET_COUNT];
+} __attribute__((aligned(CACHE_LINE_SIZE))) StatsSlot;
+
+typedef struct {
+    ulong cycles;
+    ulong nanoseconds;
+} StatsTimer;
+
+// Set by statsInit, every measure is skipped otherwise
+extern bool statsEnabled;
+
+/** The time stamp counter where there is one, the monotonic clock in nanoseconds elsewhere. */
+static inline ulong statsCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+#endif
+}
+
+static inline void statsAdd(StatsSlot* slot, StatsPhase phase, ulong cycles, ulong units) {
+    slot->cycles[phase] += cycles;
+    slot->units[phase] += units;
+}
+
+static inline void statsAddLatency(StatsSlot* slot, ulong cycles) {
+    slot->histogram[63 - __builtin_clzl(cycles | 1)]++;
+}
+
+void statsInit(ulong workerCount);
+
+void statsShutdown();
+
+StatsSlot* statsSlot(ulong threadId);
+
+const char* statsPhaseName(StatsPhase phase);
+
+void statsBegin(StatsTimer* timer);
+
+void statsEnd(ulong threadId, StatsPhase phase, const StatsTimer* timer);
+
+void statsPrint(FILE* file);
+
+bool statsWriteJson(const char* path);
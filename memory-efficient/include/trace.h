@@ -0,0 +1,33 @@
+#pragma once
+#include "defines.h"
+
+typedef enum {
+    TRACE_SIEVE_SEGMENT = 0,
+    TRACE_SPF_SEGMENT,
+    TRACE_DECOMPOSE_CHUNK,
+    // A worker waiting for the reorder window to let its chunk in
+    TRACE_WINDOW_WAIT,
+    // A worker handing a chunk over, under the writer lock
+    TRACE_SUBMIT,
+    // The writer waiting for the next chunk in sequence
+    TRACE_CHUNK_WAIT,
+    TRACE_FLUSH,
+    TRACE_KIND_COUNT
+} TraceKind;
+
+// Events kept per thread, the oldest are overwritten past that
+#define TRACE_BUFFER_EVENTS (1 << 16)
+
+// Set by traceInit, every other call does nothing otherwise
+extern bool traceEnabled;
+
+void traceInit(ulong workerCount);
+
+void traceShutdown();
+
+/** Nanoseconds since traceInit, 0 when tracing is off. */
+ulong traceNow();
+
+void traceRecord(ulong threadId, TraceKind kind, ulong start, ulong first, ulong second);
+
+bool traceWrite(const char* path);
@@ -0,0 +1,35 @@
+#pragma once
+#include "defines.h"
+#include "inverse-table.h"
+
+// The kernels test 32-bit numbers, so they only need primes up to 2^16
+#define TRIAL_KERNEL_PRIME_LIMIT (1UL << 16)
+// Widest vector, in 32-bit lanes. The table is padded past its end by this many entries.
+#define TRIAL_KERNEL_MAX_LANES 16
+
+typedef enum { TRIAL_KERNEL_SCALAR = 0, TRIAL_KERNEL_AVX2, TRIAL_KERNEL_AVX512 } TrialKernelLevel;
+
+typedef struct TrialKernelTable TrialKernelTable;
+
+/** Returns the index of the first prime from START on that divides NUMBER or goes above ROOT. */
+typedef ulong (*TrialKernel)(const TrialKernelTable* table, ulong start, uint number, uint root);
+
+/** The odd primes of the inverse table below TRIAL_KERNEL_PRIME_LIMIT, with 32-bit constants, one array each. */
+struct TrialKernelTable {
+    ulong count;
+    uint* primes;
+    uint* inverses;
+    uint* limits;
+    TrialKernelLevel level;
+    TrialKernel find;
+};
+
+void trialKernelTableInit(TrialKernelTable* table, const PrimeInverse* entries, ulong entryCount);
+
+void trialKernelTableDestroy(TrialKernelTable* table);
+
+TrialKernelLevel trialKernelBestLevel(void);
+
+TrialKernel trialKernelGet(TrialKernelLevel level);
+
+const char* trialKernelName(TrialKernelLevel level);
@@ -0,0 +1,73 @@
+#include "block-sieve.h"
+#include "darray.h"
+
+#include <stdlib.h>
+
+void factorBlockInit(FactorBlock* block) {
+    block->first = 0;
+    block->length = 0;
+    block->cofactors = malloc(sizeof *block->cofactors * BLOCK_SIEVE_SIZE);
+    block->factors = malloc(sizeof *block->factors * BLOCK_SIEVE_SIZE * BLOCK_MAX_FACTORS);
+    block->exponents = malloc(sizeof *block->exponents * BLOCK_SIEVE_SIZE * BLOCK_MAX_FACTORS);
+    block->factorCounts = malloc(sizeof *block->factorCounts * BLOCK_SIEVE_SIZE);
+}
+
+void factorBlockDestroy(FactorBlock* block) {
+    free(block->cofactors);
+    free(block->factors);
+    free(block->exponents);
+    free(block->factorCounts);
+}
+
+/** Factors the LENGTH consecutive numbers starting at FIRST.
+ *  Each base prime strikes its multiples in the block and divides its powers out of them,
+ *  so once every prime up to the square root of the block end went through,
+ *  whatever is left of a number is either 1 or its single prime factor above that root.
+ *  @param darrayBasePrimes Every prime up to the square root of FIRST + LENGTH - 1
+ *  LENGTH must not exceed BLOCK_SIEVE_SIZE.
+ */
+void factorBlockSieve(FactorBlock* block, const ulong* darrayBasePrimes, ulong first, ulong length) {
+    block->first = first;
+    block->length = length;
+    for (ulong i = 0; i < length; i++) {
+        block->cofactors[i] = first + i;
+        block->factorCounts[i] = 0;
+    }
+
+    ulong last = first + length - 1;
+    ulong primeCount = darrayLength(darrayBasePrimes);
+    for (ulong j = 0; j < primeCount; j++) {
+        ulong p = darrayBasePrimes[j];
+        if (p * p > last)
+            break;
+        // Primes themselves are left alone, so that they keep an empty decomposition
+        ulong multiple = first > 2 * p ? (first + p - 1) / p * p : 2 * p;
+        for (ulong k = multiple - first; k < length; k += p) {
+            ulong cofactor = block->cofactors[k];
+            uchar exponent = 0;
+            do {
+                cofactor /= p;
+                exponent++;
+            } while (cofactor % p == 0);
+            block->cofactors[k] = cofactor;
+            ulong slot = k * BLOCK_MAX_FACTORS + block->factorCounts[k]++;
+            block->factors[slot] = p;
+            block->exponents[slot] = exponent;
+        }
+    }
+}
+
+void factorBlockGet(const FactorBlock* block, ulong index, ulong** darrayFactorsP, ulong** darrayFactorCountsP) {
+    uchar factorCount = block->factorCounts[index];
+    if (factorCount == 0)
+        return;
+    for (uchar i = 0; i < factorCount; i++) {
+        ulong slot = index * BLOCK_MAX_FACTORS + i;
+        darrayAdd(darrayFactorsP, (ulong)block->factors[slot]);
+        darrayAdd(darrayFactorCountsP, (ulong)block->exponents[slot]);
+    }
+    if (block->cofactors[index] > 1) {
+        darrayAdd(darrayFactorsP, block->cofactors[index]);
+        darrayAdd(darrayFactorCountsP, 1UL);
+    }
+}
@@ -0,0 +1,174 @@
+#include "checkpoint.h"
+#include "darray.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECKSUM_SEED 0xcbf29ce484222325UL
+#define CHECKSUM_PRIME 0x100000001b3UL
+// Bytes read at once when checking a file against its checksum
+#define CHECKSUM_READ_SIZE (1 << 20)
+
+static ulong now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec;
+}
+
+void checksumInit(Checksum* checksum) {
+    checksum->state = CHECKSUM_SEED;
+    checksum->pending = 0;
+    checksum->pendingCount = 0;
+    checksum->length = 0;
+}
+
+/** FNV-1a over 8-byte words instead of bytes, so the writer can keep up with the workers. */
+void checksumUpdate(Checksum* checksum, const void* data, size_t length) {
+    const uchar* bytes = data;
+    const uchar* end = bytes + length;
+    checksum->length += length;
+    while (checksum->pendingCount > 0 && checksum->pendingCount < 8 && bytes < end) {
+        checksum->pending |= (ulong)*bytes++ << (8 * checksum->pendingCount++);
+    }
+    if (checksum->pendingCount == 8) {
+        checksum->state = (checksum->state ^ checksum->pending) * CHECKSUM_PRIME;
+        checksum->pending = 0;
+        checksum->pendingCount = 0;
+    }
+    for (; end - bytes >= 8; bytes += 8) {
+        ulong word;
+        memcpy(&word, bytes, 8);
+        checksum->state = (checksum->state ^ word) * CHECKSUM_PRIME;
+    }
+    while (bytes < end) {
+        checksum->pending |= (ulong)*bytes++ << (8 * checksum->pendingCount++);
+    }
+}
+
+bool checksumEqual(const Checksum* a, const Checksum* b) {
+    return a->state == b->state && a->pending == b->pending && a->pendingCount == b->pendingCount &&
+           a->length == b->length;
+}
+
+/** Computes the checksum of the bytes [START, END) of the file FD.
+ *  @return FALSE if the file is shorter than END or could not be read.
+ */
+bool checksumFile(Checksum* checksum, int fd, ulong start, ulong end) {
+    checksumInit(checksum);
+    uchar* data = malloc(CHECKSUM_READ_SIZE);
+    ulong position = start;
+    while (position < end) {
+        ulong size = end - position < CHECKSUM_READ_SIZE ? end - position : CHECKSUM_READ_SIZE;
+        ssize_t result = pread(fd, data, size, position);
+        if (result <= 0) {
+            free(data);
+            return FALSE;
+        }
+        checksumUpdate(checksum, data, result);
+        position += result;
+    }
+    free(data);
+    return TRUE;
+}
+
+void checkpointInit(Checkpoint* checkpoint, const char* path, ulong first, ulong limit, ulong output) {
+    memset(&checkpoint->record, 0, sizeof checkpoint->record);
+    memcpy(checkpoint->record.magic, CHECKPOINT_MAGIC, sizeof checkpoint->record.magic);
+    checkpoint->record.first = first;
+    checkpoint->record.limit = limit;
+    checkpoint->record.output = output;
+    checksumInit(&checkpoint->record.outputChecksum);
+    checkpoint->path = path;
+    checkpoint->darrayIndex = darrayCreate(64, sizeof(ulong));
+    checkpoint->lastSave = now();
+}
+
+/** Reads the checkpoint at PATH.
+ *  @return FALSE if there is none or it is not a checkpoint file, CHECKPOINT is then left uninitialized.
+ */
+bool checkpointLoad(Checkpoint* checkpoint, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return FALSE;
+    CheckpointRecord* record = &checkpoint->record;
+    if (fread(record, sizeof *record, 1, file) != 1 || memcmp(record->magic, CHECKPOINT_MAGIC, sizeof record->magic)) {
+        fclose(file);
+        return FALSE;
+    }
+    checkpoint->path = path;
+    checkpoint->darrayIndex = darrayCreate(record->indexCount + 1, sizeof(ulong));
+    darrayResize(&checkpoint->darrayIndex, record->indexCount);
+    bool complete = fread(checkpoint->darrayIndex, sizeof(ulong), record->indexCount, file) == record->indexCount;
+    fclose(file);
+    if (!complete) {
+        darrayDestroy(checkpoint->darrayIndex);
+        return FALSE;
+    }
+    checkpoint->lastSave = now();
+    return TRUE;
+}
+
+/** Forgets the progress of the decomposition phase, the output will start over at OUTPUTSTART. */
+void checkpointResetOutput(Checkpoint* checkpoint, ulong chunkSize, ulong outputStart) {
+    CheckpointRecord* record = &checkpoint->record;
+    record->chunkSize = chunkSize;
+    record->nextChunk = 0;
+    record->nextNumber = record->first;
+    record->outputStart = outputStart;
+    record->outputOffset = outputStart;
+    record->indexCount = 0;
+    checksumInit(&record->outputChecksum);
+    darrayClear(checkpoint->darrayIndex);
+}
+
+/** Records that every chunk before NEXTCHUNK is in the output, which ends at OUTPUTOFFSET. */
+void checkpointRecordOutput(Checkpoint* checkpoint, ulong nextChunk, ulong outputOffset, const Checksum* checksum,
+                            const ulong* darrayIndex) {
+    CheckpointRecord* record = &checkpoint->record;
+    record->nextChunk = nextChunk;
+    ulong span = record->limit - record->first;
+    record->nextNumber = record->first + (nextChunk * record->chunkSize < span ? nextChunk * record->chunkSize : span);
+    record->outputOffset = outputOffset;
+    record->outputChecksum = *checksum;
+    ulong indexCount = darrayLength(darrayIndex);
+    if (indexCount > record->indexCount)
+        darrayAppend(&checkpoint->darrayIndex, darrayIndex + record->indexCount, indexCount - record->indexCount);
+    record->indexCount = indexCount;
+}
+
+bool checkpointDue(const Checkpoint* checkpoint) { return now() - checkpoint->lastSave >= CHECKPOINT_INTERVAL; }
+
+/** Replaces the checkpoint file with the current record.
+ *  The output file OUTPUTFD is synced first, so the checkpoint never claims data that could still be lost.
+ *  The record goes to a temporary file renamed over the old one, a crash leaves either of them whole.
+ */
+void checkpointSave(Checkpoint* checkpoint, int outputFd) {
+    if (outputFd >= 0)
+        fdatasync(outputFd);
+    char temporaryPath[PATH_MAX];
+    snprintf(temporaryPath, sizeof temporaryPath, "%s.tmp", checkpoint->path);
+    FILE* file = fopen(temporaryPath, "wb");
+    if (!file)
+        err(5, "Could not write checkpoint %s", temporaryPath);
+    CheckpointRecord* record = &checkpoint->record;
+    fwrite(record, sizeof *record, 1, file);
+    fwrite(checkpoint->darrayIndex, sizeof(ulong), record->indexCount, file);
+    fflush(file);
+    fsync(fileno(file));
+    if (fclose(file) != 0 || rename(temporaryPath, checkpoint->path) != 0)
+        err(5, "Could not write checkpoint %s", checkpoint->path);
+    checkpoint->lastSave = now();
+}
+
+/** Frees the checkpoint, and deletes its file if REMOVE is set, once the run it covers is complete. */
+void checkpointDestroy(Checkpoint* checkpoint, bool remove) {
+    if (remove)
+        unlink(checkpoint->path);
+    darrayDestroy(checkpoint->darrayIndex);
+}
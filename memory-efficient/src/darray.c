@@ -82,3 +82,28 @@ void _darrayInsert(void **darrayp, const void *element, ulong index) {
     darraySetField(darray, DARRAY_LENGTH_FIELD, length + 1);
     *darrayp = darray;
 }
+
+void _darrayResize(void **darrayp, ulong length) {
+    void* darray = *darrayp;
+    ulong stride = darrayStride(darray);
+
+    if (length > darrayCapacity(darray)) {
+        ulong capacity = darrayCapacity(darray) * 1.5;
+        if (capacity < length)
+            capacity = length;
+        ulong headerSize = sizeof(ulong) * 3;
+        void* header = realloc(darray - headerSize, headerSize + capacity * stride);
+        darray = header + headerSize;
+        darraySetField(darray, DARRAY_CAPACITY_FIELD, capacity);
+    }
+    darraySetField(darray, DARRAY_LENGTH_FIELD, length);
+    *darrayp = darray;
+}
+
+void _darrayAppend(void **darrayp, const void *elements, ulong count) {
+    ulong length = darrayLength(*darrayp);
+    ulong stride = darrayStride(*darrayp);
+
+    _darrayResize(darrayp, length + count);
+    memcpy(*darrayp + length * stride, elements, count * stride);
+}
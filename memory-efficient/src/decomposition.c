@@ -1,15 +1,27 @@
 #include "decomposition.h"
 
 #include <err.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "block-sieve.h"
+#include "prime-cache.h"
 #include "darray.h"
+#include "factor-table.h"
+#include "factor.h"
+#include "format.h"
+#include "ordered-output.h"
+#include "perf-counters.h"
+#include "primality.h"
 #include "primes.h"
 #include "progress.h"
-
-static pthread_mutex_t fileMutex;
+#include "sieve.h"
+#include "stats.h"
+#include "trace.h"
 
 static ulong sqr(ulong num) { return num * num; }
 
@@ -30,140 +42,448 @@ static ulong indexOfPrime(const ulong* primes, ulong primeCount, ulong prime) {
     return -1;
 }
 
-static ulong getNextPrime(FILE* primeListFile) {
-    ulong buffer = 0;
-    ulong result = fread(&buffer, sizeof buffer, 1, primeListFile);
-    if (result != 1) {
-        if (feof(primeListFile))
-            err(7, "No more primes, end of file !\n");
-        else
-            err(6, "Could not read prime list.\n");
+/** Adds what is left of STARTINGNUMBER after trial division to the FACTORCOUNT factors found so far.
+ *  When the primes ran out before the square root of the remainder, it may still be composite.
+ *  @return The new factor count.
+ */
+static ulong addRemainder(ulong* factors, ulong* factorCounts, ulong factorCount, ulong number, ulong startingNumber,
+                          bool primesExhausted) {
+    if (number <= 1)
+        return factorCount;
+    if (!primesExhausted || isPrime(number)) {
+        if (number != startingNumber) {
+            factors[factorCount] = number;
+            factorCounts[factorCount++] = 1;
+        }
+        return factorCount;
     }
-    return buffer;
+    // The primes ran out on a composite remainder, its factors are all above them
+    return factorCount + factorNumber(number, factors + factorCount, factorCounts + factorCount);
+}
+
+static void addRemainderToDarrays(ulong** darrayFactorsP, ulong** darrayFactorCountsP, ulong number,
+                                  ulong startingNumber, bool primesExhausted) {
+    ulong factors[MAX_DISTINCT_FACTORS];
+    ulong factorCounts[MAX_DISTINCT_FACTORS];
+    ulong factorCount = addRemainder(factors, factorCounts, 0, number, startingNumber, primesExhausted);
+    darrayAppend(darrayFactorsP, factors, factorCount);
+    darrayAppend(darrayFactorCountsP, factorCounts, factorCount);
 }
 
-bool isPrime(FILE* primeListFile, ulong primeCount, ulong number) {
-    bool isPrime = TRUE;
+/** Decomposes NUMBER by trial division with the PRIMECOUNT first PRIMES, without allocating anything.
+ *  What the primes cannot reach is split by factorNumber.
+ *  @param factors, factorCounts Room for MAX_DISTINCT_FACTORS entries each
+ *  @return The number of distinct prime factors, 0 for prime numbers and numbers below 4.
+ */
+ulong trialDecompose(const ulong* primes, ulong primeCount, ulong number, ulong* factors, ulong* factorCounts) {
     ulong p;
-    for (ulong j = 0; j < primeCount && sqr(p = getNextPrime(primeListFile)) <= number; j++) {
-        if (number % p == 0) {
-            isPrime = FALSE;
-            break;
-        }
+    ulong j = 0;
+    ulong factorCount = 0;
+    ulong startingNumber = number;
+    for (; j < primeCount && sqr(p = primes[j]) <= number; j++) {
+        if (number % p != 0)
+            continue;
+        ulong count = 0;
+        do {
+            number /= p;
+            count++;
+        } while (number % p == 0);
+        factors[factorCount] = p;
+        factorCounts[factorCount++] = count;
     }
-    return isPrime;
+    return addRemainder(factors, factorCounts, factorCount, number, startingNumber, j == primeCount);
 }
 
-static void decomposeSingle(FILE* primeListFile, ulong** darrayFactorsP, ulong** darrayFactorCountsP, size_t primeCount,
+static void decomposeSingle(const ulong* primes, ulong** darrayFactorsP, ulong** darrayFactorCountsP, size_t primeCount,
                             ulong number) {
-    ulong p;
+    ulong factors[MAX_DISTINCT_FACTORS];
+    ulong factorCounts[MAX_DISTINCT_FACTORS];
+    ulong factorCount = trialDecompose(primes, primeCount, number, factors, factorCounts);
+    darrayAppend(darrayFactorsP, factors, factorCount);
+    darrayAppend(darrayFactorCountsP, factorCounts, factorCount);
+}
+
+// Exact for every 32-bit number, a double holds it without rounding and the root stays far from the next integer
+static uint rootOf32(uint number) { return (uint)__builtin_sqrt((double)number); }
+
+/** Trial division of a 32-bit NUMBER, the kernel tests a whole vector of primes before each branch. */
+static void decomposeKernel(const TrialKernelTable* table, ulong** darrayFactorsP, ulong** darrayFactorCountsP,
+                            uint number, ulong startingNumber) {
+    uint root = rootOf32(number);
     ulong j = 0;
+    while ((j = table->find(table, j, number, root)) < table->count && table->primes[j] <= root) {
+        uint inverse = table->inverses[j];
+        uint quotient = number * inverse;
+        ulong count = 0;
+        do {
+            number = quotient;
+            count++;
+            quotient = number * inverse;
+        } while (quotient <= table->limits[j]);
+        darrayAdd(darrayFactorsP, (ulong)table->primes[j]);
+        darrayAdd(darrayFactorCountsP, count);
+        root = rootOf32(number);
+        j++;
+    }
+    addRemainderToDarrays(darrayFactorsP, darrayFactorCountsP, number, startingNumber, j >= table->count);
+}
+
+/** Same as decomposeSingle, but each test is a multiplication by the inverse of the prime instead of a division.
+ *  Numbers that fit in 32 bits go through the vector kernel.
+ */
+static void decomposeInverse(const DecompData* data, ulong** darrayFactorsP, ulong** darrayFactorCountsP,
+                             ulong number) {
+    const PrimeInverse* inverses = data->inverses;
     ulong startingNumber = number;
-    bool newFactor = 1;
-    while (sqr(p = getNextPrime(primeListFile)) <= number) {
-        if (number % p == 0) {
-            number /= p;
-            if (newFactor) {
-                darrayAdd(darrayFactorsP, p);
-                darrayAdd(darrayFactorCountsP, 1L);
-                newFactor = 0;
-            } else {
-                (*darrayFactorCountsP)[darrayLength(*darrayFactorCountsP) - 1]++;
-            }
-        } else {
-            j++;
-            newFactor = 1;
-        }
+    if (data->inverseCount == 0 || number < 4)
+        return;
+    if ((number & 1) == 0) {
+        ulong count = __builtin_ctzl(number);
+        number >>= count;
+        darrayAdd(darrayFactorsP, 2UL);
+        darrayAdd(darrayFactorCountsP, count);
     }
-    if (number > 1) {
-        if (isPrime(primeListFile, primeCount, number)) {
-            if (number != startingNumber) {
-                darrayAdd(darrayFactorsP, number);
-                darrayAdd(darrayFactorCountsP, 1L);
-            }
-        } else {
-            // The remainder is not a prime number !
-            // the while loop above did some shenanigans for us to be here
-            err(17, "Decomposition ended with a non-prime number different from 1 : %zu\n", number);
+    if (number <= 0xFFFFFFFFUL && data->kernelTable) {
+        decomposeKernel(data->kernelTable, darrayFactorsP, darrayFactorCountsP, number, startingNumber);
+        return;
+    }
+    ulong j = 1;
+    for (; j < data->inverseCount && sqr(inverses[j].prime) <= number; j++) {
+        const PrimeInverse* entry = inverses + j;
+        ulong quotient = number * entry->inverse;
+        if (quotient > entry->limit)
+            continue;
+        ulong count = 0;
+        do {
+            number = quotient;
+            count++;
+            quotient = number * entry->inverse;
+        } while (quotient <= entry->limit);
+        darrayAdd(darrayFactorsP, entry->prime);
+        darrayAdd(darrayFactorCountsP, count);
+    }
+    addRemainderToDarrays(darrayFactorsP, darrayFactorCountsP, number, startingNumber, j >= data->inverseCount);
+}
+
+/** Per-worker state of the output file, the consumer a run uses when it is not given one. */
+typedef struct {
+    OrderedWriter* writer;
+    const PrimeLookup* primeLookup;
+    DecompOutput output;
+    ulong firstNumber;
+    ulong threadId;
+    OutputChunk* chunk;
+} FileOutput;
+
+static void beginFileChunk(void* context, ulong sequence) {
+    FileOutput* file = context;
+    ulong start = traceNow();
+    file->chunk = orderedWriterAcquire(file->writer, sequence);
+    traceRecord(file->threadId, TRACE_WINDOW_WAIT, start, sequence, 0);
+}
+
+static void endFileChunk(void* context, ulong sequence) {
+    FileOutput* file = context;
+    ulong start = traceNow();
+    orderedWriterSubmit(file->writer, sequence);
+    traceRecord(file->threadId, TRACE_SUBMIT, start, sequence, 0);
+}
+
+/** Formats a decomposition into the buffer of the chunk at hand, as a text line or a binary record. */
+static int writeFactorsToFile(void* context, ulong number, const ulong* factors, const ulong* factorCounts,
+                              ulong factorCount) {
+    FileOutput* file = context;
+    OutputBuffer* buffer = &file->chunk->buffer;
+    if (file->output == DECOMP_OUTPUT_BINARY) {
+        if ((number - file->firstNumber) % FACTOR_TABLE_INDEX_INTERVAL == 0)
+            darrayAdd(&file->chunk->darrayMarks, buffer->length);
+        outputBufferReserve(buffer, FACTOR_TABLE_RECORD_MAX);
+        factorTableEncode(buffer, file->primeLookup, factors, factorCounts, factorCount);
+    } else {
+        outputBufferReserve(buffer, FORMAT_LINE_MAX);
+        formatFactorLine(buffer, number, factors, factorCounts, factorCount);
+    }
+    return 0;
+}
+
+static const DecompConsumer fileConsumer = {
+    .consume = writeFactorsToFile,
+    .beginChunk = beginFileChunk,
+    .endChunk = endFileChunk,
+};
+
+/** @return 0, or the nonzero value the consumer stopped at. */
+static int decomposeBlock(DecompData* data, FactorBlock* block, ulong** darrayFactorsP, ulong** darrayFactorCountsP,
+                          ulong first, ulong last) {
+    ulong length = last - first;
+    // The sieve counts in the factorization phase, but only what is left to do per number goes in the histogram
+    StatsSlot* stats = statsEnabled ? statsSlot(data->threadId) : NULL;
+    ulong start = stats ? statsCycles() : 0;
+    factorBlockSieve(block, data->darrayBasePrimes, first, length);
+    if (stats)
+        statsAdd(stats, STATS_FACTORIZE, statsCycles() - start, 0);
+    for (ulong i = 0; i < length; i++) {
+        start = stats ? statsCycles() : 0;
+        darrayClear(*darrayFactorsP);
+        darrayClear(*darrayFactorCountsP);
+        factorBlockGet(block, i, darrayFactorsP, darrayFactorCountsP);
+        ulong factorized = stats ? statsCycles() : 0;
+        int result = data->consumer->consume(data->consumerContext, first + i, *darrayFactorsP, *darrayFactorCountsP,
+                                             darrayLength(*darrayFactorsP));
+        if (stats) {
+            statsAdd(stats, STATS_FACTORIZE, factorized - start, 1);
+            statsAddLatency(stats, factorized - start);
+            statsAdd(stats, STATS_FORMAT, statsCycles() - factorized, 1);
         }
+        registerProgress(data->threadId);
+        if (result)
+            return result;
     }
+    return 0;
 }
 
-static void writeFactorsToFile(const ulong* darrayFactors, const ulong* darrayFactorCounts, ulong number, FILE* file) {
-    pthread_mutex_lock(&fileMutex);
-    ulong factorCount = darrayLength(darrayFactors);
-    if (factorCount != 0) {
-        bool first = TRUE;
-        fprintf(file, "%zu", number);
-        for (ulong j = 0; j < factorCount; j++) {
-            ulong p = darrayFactors[j];
-            ulong c = darrayFactorCounts[j];
-            if (c == 0) continue;
-            if (first) {
-                fprintf(file, "%s", " = ");
-                first = FALSE;
-            } else
-                fprintf(file, "%s", " * ");
-
-            fprintf(file, "%zu", p);
-            if (c > 1) fprintf(file, "^%zu", c);
+/** @return 0, or the nonzero value the consumer stopped at. */
+static int decomposeNumbers(DecompData* data, ulong** darrayFactorsP, ulong** darrayFactorCountsP, ulong first,
+                            ulong last) {
+    StatsSlot* stats = statsEnabled ? statsSlot(data->threadId) : NULL;
+    for (ulong i = first; i < last; i++) {
+        ulong start = stats ? statsCycles() : 0;
+        darrayClear(*darrayFactorsP);
+        darrayClear(*darrayFactorCountsP);
+        if (data->engine == DECOMP_SPF_TABLE) {
+            spfDecompose(data->spfTable, i, darrayFactorsP, darrayFactorCountsP);
+        } else if (data->engine == DECOMP_TRIAL_INVERSE) {
+            decomposeInverse(data, darrayFactorsP, darrayFactorCountsP, i);
+        } else {
+            decomposeSingle(data->primes, darrayFactorsP, darrayFactorCountsP, data->primeCount, i);
+        }
+        ulong factorized = stats ? statsCycles() : 0;
+        int result = data->consumer->consume(data->consumerContext, i, *darrayFactorsP, *darrayFactorCountsP,
+                                             darrayLength(*darrayFactorsP));
+        if (stats) {
+            statsAdd(stats, STATS_FACTORIZE, factorized - start, 1);
+            statsAddLatency(stats, factorized - start);
+            statsAdd(stats, STATS_FORMAT, statsCycles() - factorized, 1);
         }
-        fprintf(file, "%s", "\n");
+        registerProgress(data->threadId);
+        if (result)
+            return result;
     }
-    pthread_mutex_unlock(&fileMutex);
+    return 0;
 }
 
-void* decompose(void* input) {
+/** Takes chunks of the range from the shared queue until it runs dry or a consumer stops the run.
+ *  Every decomposition goes to the consumer with the context of this worker. The output file consumer formats
+ *  each chunk into its own buffer and hands it to the writer with its sequence number,
+ *  so the output comes out in order whatever the thread count.
+ */
+static void* decompose(void* input) {
     DecompData* data = (DecompData*)input;
-    // ulong factors[data->primeCount];
+    const DecompConsumer* consumer = data->consumer;
+    // The counters cannot tell the consumer apart, formatting counts as factorization here
+    PerfCounters counters;
+    perfBegin(&counters);
     ulong* darrayFactors = darrayCreate(4, sizeof(ulong));
     ulong* darrayFactorCounts = darrayCreate(4, sizeof(ulong));
-    for (ulong i = data->firstNumber; i < data->lastNumber; i++) {
-        darrayClear(darrayFactors);
-        darrayClear(darrayFactorCounts);
-        decomposeSingle(data->primeListFile, &darrayFactors, &darrayFactorCounts, data->primeCount, i);
-        // Saving to file
-        writeFactorsToFile(darrayFactors, darrayFactorCounts, i, data->outputFile);
-        registerProgress(data->threadId);
-        rewind(data->primeListFile);
+    FactorBlock block;
+    if (data->engine == DECOMP_BLOCK_SIEVE)
+        factorBlockInit(&block);
+
+    ulong sequence;
+    while (atomic_load_explicit(data->stopValue, memory_order_relaxed) == 0 &&
+           (sequence = atomic_fetch_add_explicit(data->nextChunk, 1, memory_order_relaxed)) < data->chunkCount) {
+        ulong first = data->firstNumber + sequence * DECOMP_CHUNK_SIZE;
+        ulong last = data->lastNumber - first > DECOMP_CHUNK_SIZE ? first + DECOMP_CHUNK_SIZE : data->lastNumber;
+        ulong start = traceNow();
+        if (consumer->beginChunk)
+            consumer->beginChunk(data->consumerContext, sequence);
+        int result;
+        if (data->engine == DECOMP_BLOCK_SIEVE)
+            result = decomposeBlock(data, &block, &darrayFactors, &darrayFactorCounts, first, last);
+        else
+            result = decomposeNumbers(data, &darrayFactors, &darrayFactorCounts, first, last);
+        if (consumer->endChunk)
+            consumer->endChunk(data->consumerContext, sequence);
+        traceRecord(data->threadId, TRACE_DECOMPOSE_CHUNK, start, first, last);
+        int expected = 0;
+        if (result)
+            atomic_compare_exchange_strong(data->stopValue, &expected, result);
     }
+
+    if (data->engine == DECOMP_BLOCK_SIEVE)
+        factorBlockDestroy(&block);
     darrayDestroy(darrayFactors);
     darrayDestroy(darrayFactorCounts);
+    perfEnd(&counters, data->threadId, STATS_FACTORIZE);
     return NULL;
 }
 
-void launchDecomposition(const char* primeListPath, size_t primeCount, size_t tableSize, const char* filePath,
-                         size_t threadCount) {
-    pthread_mutex_init(&fileMutex, NULL);
-    startProgressReport(tableSize - 1);
-    size_t perThread = tableSize / threadCount;
-    size_t surplus = tableSize % threadCount;
+/** Picks the output up where CHECKPOINT left it, if FILE still holds exactly what it recorded.
+ *  Otherwise the output and the checkpoint start over.
+ *  @return The first chunk left to decompose.
+ */
+static ulong resumeOutput(Checkpoint* checkpoint, int file, ulong outputStart) {
+    CheckpointRecord* record = &checkpoint->record;
+    if (record->nextChunk > 0 && record->chunkSize == DECOMP_CHUNK_SIZE && record->outputStart == outputStart) {
+        Checksum checksum;
+        if (checksumFile(&checksum, file, record->outputStart, record->outputOffset) &&
+            checksumEqual(&checksum, &record->outputChecksum)) {
+            if (ftruncate(file, record->outputOffset) < 0)
+                err(5, "Could not truncate the output file");
+            lseek(file, record->outputOffset, SEEK_SET);
+            return record->nextChunk;
+        }
+        fprintf(stderr, "The output file does not match the checkpoint, starting over.\n");
+    }
+    checkpointResetOutput(checkpoint, DECOMP_CHUNK_SIZE, outputStart);
+    return 0;
+}
+
+/** Opens the output file of SETTINGS, at the chunk CHECKPOINT recorded or with a new header.
+ *  @param firstChunkP Set to the first chunk left to decompose
+ */
+static int openOutput(const DecompSettings* settings, ulong first, ulong last, ulong* firstChunkP) {
+    Checkpoint* checkpoint = settings->checkpoint;
+    ulong base = settings->outputBase;
+    int file = open(settings->outputPath, O_RDWR | O_CREAT | (checkpoint || base ? 0 : O_TRUNC), 0644);
+    if (file < 0)
+        err(5, "Could not open output file %s", settings->outputPath);
+    ulong outputStart = base + (settings->output == DECOMP_OUTPUT_BINARY ? sizeof(FactorTableHeader) : 0);
+    *firstChunkP = checkpoint ? resumeOutput(checkpoint, file, outputStart) : 0;
+    if (*firstChunkP == 0) {
+        if (ftruncate(file, base) < 0)
+            err(5, "Could not truncate the output file");
+        lseek(file, base, SEEK_SET);
+        if (settings->output == DECOMP_OUTPUT_BINARY)
+            factorTableWriteHeader(file, base, first, last);
+    }
+    return file;
+}
+
+/** Waits for WRITER to write every chunk, then ends the binary table with its index. */
+static void closeOutput(const DecompSettings* settings, OrderedWriter* writer, int file, ulong first, ulong last) {
+    orderedWriterFinish(writer);
+    if (settings->output == DECOMP_OUTPUT_BINARY) {
+        for (ulong i = 0; i < darrayLength(writer->darrayOffsets); i++) {
+            writer->darrayOffsets[i] -= settings->outputBase;
+        }
+        factorTableWriteIndex(file, settings->outputBase, first, last, writer->darrayOffsets);
+    }
+    darrayDestroy(writer->darrayOffsets);
+    close(file);
+}
+
+/** Decomposes every number of [SETTINGS->firstNumber, SETTINGS->lastNumber),
+ *  into SETTINGS->outputPath or, when one is given, to SETTINGS->consumer.
+ *  With a checkpoint, an output file continues from the chunk it recorded and saves it regularly.
+ *  @return 0, or the nonzero value a consumer stopped the run with.
+ */
+int launchDecomposition(const DecompSettings* settings) {
+    ulong first = settings->firstNumber;
+    ulong last = settings->lastNumber > first ? settings->lastNumber : first;
+    size_t threadCount = settings->threadCount;
+    DecompEngine engine = settings->engine;
+    bool toFile = settings->consumer == NULL;
+    // Trial division never needs a prime above the square root of the last number
+    ulong rootLimit = last > 0 ? integerSqrt(last - 1) + 1 : 0;
+    SpfTable spfTable;
+    PrimeCache primeCache = {0};
+    InverseTable inverseTable = {0};
+    TrialKernelTable kernelTable;
+    const ulong* darrayBasePrimes = settings->darrayBasePrimes;
+    bool ownsBasePrimes = engine == DECOMP_BLOCK_SIEVE && !darrayBasePrimes;
+    // The binary table stores prime indices, so it needs the cache whatever the engine
+    bool needsPrimeCache = engine == DECOMP_TRIAL_DIVISION || (toFile && settings->output == DECOMP_OUTPUT_BINARY);
+    if (needsPrimeCache && !primeCacheOpen(&primeCache, settings->primeListPath))
+        err(4, "Could not map prime number cache %s", settings->primeListPath);
+    // Every factor of the window is below its end, and records look up the index of each of them
+    PrimeLookup primeLookup = {0};
+    if (toFile && settings->output == DECOMP_OUTPUT_BINARY)
+        primeLookupInit(&primeLookup, &primeCache, last);
+    ulong* darrayTrialPrimes = NULL;
+    if (engine == DECOMP_TRIAL_DIVISION)
+        darrayTrialPrimes = primeCacheDecode(&primeCache, rootLimit);
+    if (engine == DECOMP_TRIAL_INVERSE && !inverseTableOpen(&inverseTable, settings->inverseListPath))
+        err(4, "Could not map prime inverse table %s", settings->inverseListPath);
+    if (engine == DECOMP_TRIAL_INVERSE)
+        trialKernelTableInit(&kernelTable, inverseTable.entries, inverseTable.count);
+    StatsTimer timer;
+    statsBegin(&timer);
+    if (engine == DECOMP_SPF_TABLE) {
+        // The table is indexed by the numbers themselves, so it covers everything below the window too
+        spfTableBuild(&spfTable, last, threadCount);
+        statsEnd(STATS_MAIN_THREAD, STATS_SPF_TABLE, &timer);
+    } else if (ownsBasePrimes)
+        darrayBasePrimes = sieveBasePrimes(rootLimit);
+
     DecompData threadInputs[threadCount];
     pthread_t threads[threadCount];
-    ulong previousLastNumber = 0;
-    FILE* file = fopen(filePath, "w");
+    ulong chunkCount = (last - first + DECOMP_CHUNK_SIZE - 1) / DECOMP_CHUNK_SIZE;
+    ulong firstChunk = 0;
+    int file = -1;
+    OrderedWriter writer;
+    FileOutput fileOutputs[toFile ? threadCount : 1];
+    if (toFile) {
+        file = openOutput(settings, first, last, &firstChunk);
+        orderedWriterStart(&writer, file, firstChunk, chunkCount, DECOMP_WINDOW_PER_THREAD * threadCount,
+                           settings->checkpoint);
+    }
+    const DecompConsumer* consumer = toFile ? &fileConsumer : settings->consumer;
+    ulong resumeNumber = firstChunk < chunkCount ? first + firstChunk * DECOMP_CHUNK_SIZE : last;
+    startProgressReport("decompose", last - resumeNumber);
+
+    atomic_ulong nextChunk = firstChunk;
+    atomic_int stopValue = 0;
     for (size_t i = 0; i < threadCount; i++) {
         DecompData* input = threadInputs + i;
-        input->firstNumber = previousLastNumber;
-        input->lastNumber = previousLastNumber + perThread;
-        if (surplus > 0) {
-            input->lastNumber++;
-            surplus--;
-        }
-        previousLastNumber = input->lastNumber;
-        input->outputFile = file;
-        input->primeCount = primeCount;
-        input->primeListFile = fopen(primeListPath, "rb");
-        input->tableSize = tableSize;
+        input->firstNumber = first;
+        input->lastNumber = last;
+        input->chunkCount = chunkCount;
+        input->primes = darrayTrialPrimes;
+        input->primeCount = darrayTrialPrimes ? darrayLength(darrayTrialPrimes) : 0;
+        input->inverseCount = inverseTable.count;
+        input->inverses = inverseTable.entries;
+        input->kernelTable = engine == DECOMP_TRIAL_INVERSE ? &kernelTable : NULL;
         input->threadId = i;
+        input->engine = engine;
+        input->spfTable = engine == DECOMP_SPF_TABLE ? &spfTable : NULL;
+        input->darrayBasePrimes = darrayBasePrimes;
+        input->consumer = consumer;
+        if (toFile) {
+            fileOutputs[i] = (FileOutput){
+                .writer = &writer,
+                .primeLookup = &primeLookup,
+                .output = settings->output,
+                .firstNumber = first,
+                .threadId = i,
+            };
+            input->consumerContext = fileOutputs + i;
+        } else {
+            input->consumerContext = consumer->threadContexts ? consumer->threadContexts[i] : NULL;
+        }
+        input->nextChunk = &nextChunk;
+        input->stopValue = &stopValue;
         pthread_create(&threads[i], NULL, decompose, input);
     }
 
     for (size_t i = 0; i < threadCount; i++) {
         pthread_join(threads[i], NULL);
-        fclose(threadInputs[i].primeListFile);
     }
-    fclose(file);
-    pthread_mutex_destroy(&fileMutex);
+    if (toFile)
+        closeOutput(settings, &writer, file, first, last);
     stopProgressReport();
+    primeLookupDestroy(&primeLookup);
+    if (needsPrimeCache)
+        primeCacheClose(&primeCache);
+    if (engine == DECOMP_TRIAL_INVERSE) {
+        trialKernelTableDestroy(&kernelTable);
+        inverseTableClose(&inverseTable);
+    }
+    if (engine == DECOMP_TRIAL_DIVISION)
+        darrayDestroy(darrayTrialPrimes);
+    if (engine == DECOMP_SPF_TABLE)
+        spfTableDestroy(&spfTable);
+    else if (ownsBasePrimes)
+        darrayDestroy((ulong*)darrayBasePrimes);
+    return atomic_load(&stopValue);
 }
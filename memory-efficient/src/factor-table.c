@@ -0,0 +1,203 @@
+#include "factor-table.h"
+#include "darray.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uchar* encodeVarint(uchar* out, ulong value) {
+    while (value >= 0x80) {
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+/** Decodes the varint at IN, which must end before END.
+ *  @return The byte after it, or NULL if it runs past END or does not fit in a ulong.
+ */
+static const uchar* decodeVarint(const uchar* in, const uchar* end, ulong* value) {
+    ulong result = 0;
+    for (uint shift = 0; in < end && shift < 64; shift += 7) {
+        uchar byte = *in++;
+        result |= (ulong)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static void writeAll(int fd, const void* data, size_t size, off_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = pwrite(fd, (const char*)data + written, size - written, offset + written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            err(6, "Could not write factor table");
+        }
+        written += result;
+    }
+}
+
+/** Writes a header with no index yet at BASE, the records follow it directly. */
+void factorTableWriteHeader(int fd, ulong base, ulong firstNumber, ulong lastNumber) {
+    FactorTableHeader header = {
+        .firstNumber = firstNumber,
+        .lastNumber = lastNumber,
+        .indexInterval = FACTOR_TABLE_INDEX_INTERVAL,
+        .indexOffset = 0,
+    };
+    memcpy(header.magic, FACTOR_TABLE_MAGIC, sizeof header.magic);
+    writeAll(fd, &header, sizeof header, base);
+    lseek(fd, base + sizeof header, SEEK_SET);
+}
+
+/** Appends the offset index after the records and points the header at it.
+ *  Offsets in the table count from its header at BASE, so the table can be cut out of the file as is.
+ *  @param darrayIndex The offset from BASE of every FACTOR_TABLE_INDEX_INTERVAL-th record
+ */
+void factorTableWriteIndex(int fd, ulong base, ulong firstNumber, ulong lastNumber, const ulong* darrayIndex) {
+    off_t indexOffset = lseek(fd, 0, SEEK_END);
+    writeAll(fd, darrayIndex, darrayLength(darrayIndex) * sizeof *darrayIndex, indexOffset);
+    factorTableSetIndex(fd, base, firstNumber, lastNumber, indexOffset - base);
+}
+
+/** Points the header at BASE to an index already written INDEXOFFSET bytes after it. */
+void factorTableSetIndex(int fd, ulong base, ulong firstNumber, ulong lastNumber, ulong indexOffset) {
+    FactorTableHeader header = {
+        .firstNumber = firstNumber,
+        .lastNumber = lastNumber,
+        .indexInterval = FACTOR_TABLE_INDEX_INTERVAL,
+        .indexOffset = indexOffset,
+    };
+    memcpy(header.magic, FACTOR_TABLE_MAGIC, sizeof header.magic);
+    writeAll(fd, &header, sizeof header, base);
+}
+
+/** Appends the record of one number to BUFFER: its factor count,
+ *  then for each factor the distance of its prime index to the previous one and its exponent.
+ *  The caller must reserve FACTOR_TABLE_RECORD_MAX bytes beforehand.
+ */
+void factorTableEncode(OutputBuffer* buffer, const PrimeLookup* primeLookup, const ulong* factors,
+                       const ulong* factorCounts, ulong factorCount) {
+    uchar* out = (uchar*)buffer->data + buffer->length;
+    out = encodeVarint(out, factorCount);
+    ulong previous = 0;
+    for (ulong j = 0; j < factorCount; j++) {
+        ulong index = primeLookupIndexOf(primeLookup, factors[j]);
+        if (index == -1UL)
+            err(17, "%zu is not in the prime number cache\n", factors[j]);
+        out = encodeVarint(out, index - previous);
+        out = encodeVarint(out, factorCounts[j]);
+        previous = index;
+    }
+    buffer->length = (char*)out - buffer->data;
+}
+
+bool factorTableOpen(FactorTable* table, const char* path, const char* primeListPath) {
+    table->fd = open(path, O_RDONLY);
+    if (table->fd < 0)
+        return FALSE;
+    struct stat info;
+    if (fstat(table->fd, &info) < 0) {
+        close(table->fd);
+        return FALSE;
+    }
+    table->mappingSize = info.st_size;
+    if (table->mappingSize < sizeof(FactorTableHeader)) {
+        close(table->fd);
+        errno = EINVAL;
+        return FALSE;
+    }
+    table->mapping = mmap(NULL, table->mappingSize, PROT_READ, MAP_SHARED, table->fd, 0);
+    if (table->mapping == MAP_FAILED) {
+        close(table->fd);
+        return FALSE;
+    }
+    const FactorTableHeader* header = (const FactorTableHeader*)table->mapping;
+    // The records sit between the header and the index, which has an entry every indexInterval numbers
+    bool valid = memcmp(header->magic, FACTOR_TABLE_MAGIC, sizeof header->magic) == 0 &&
+                 header->indexInterval == FACTOR_TABLE_INDEX_INTERVAL && header->firstNumber <= header->lastNumber &&
+                 header->indexOffset >= sizeof *header && header->indexOffset <= table->mappingSize;
+    if (valid) {
+        ulong indexLength = (header->lastNumber - header->firstNumber + FACTOR_TABLE_INDEX_INTERVAL - 1) /
+                            FACTOR_TABLE_INDEX_INTERVAL;
+        valid = indexLength <= (table->mappingSize - header->indexOffset) / sizeof(ulong);
+    }
+    if (!valid) {
+        munmap((void*)table->mapping, table->mappingSize);
+        close(table->fd);
+        errno = EINVAL;
+        return FALSE;
+    }
+    // Lookups touch a single index entry and a few records, nothing worth reading ahead
+    madvise((void*)table->mapping, table->mappingSize, MADV_RANDOM);
+    table->header = header;
+    table->index = (const ulong*)(table->mapping + header->indexOffset);
+    if (!primeCacheOpen(&table->primeCache, primeListPath)) {
+        munmap((void*)table->mapping, table->mappingSize);
+        close(table->fd);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void factorTableClose(FactorTable* table) {
+    primeCacheClose(&table->primeCache);
+    munmap((void*)table->mapping, table->mappingSize);
+    close(table->fd);
+}
+
+/** Reads the decomposition of NUMBER back, seeking through the offset index.
+ *  Decoding never goes past the records, so a corrupt table fails the lookup instead of reading out of bounds.
+ *  @param factors, factorCounts Room for MAX_DISTINCT_FACTORS entries each
+ *  @return FALSE if NUMBER is not in the table or its record is corrupt.
+ */
+bool factorTableLookup(const FactorTable* table, ulong number, ulong* factors, ulong* factorCounts,
+                       ulong* outFactorCount) {
+    const FactorTableHeader* header = table->header;
+    if (number < header->firstNumber || number >= header->lastNumber)
+        return FALSE;
+    ulong position = number - header->firstNumber;
+    ulong offset = table->index[position / FACTOR_TABLE_INDEX_INTERVAL];
+    const uchar* end = table->mapping + header->indexOffset;
+    if (offset < sizeof *header || offset >= header->indexOffset)
+        return FALSE;
+    const uchar* in = table->mapping + offset;
+    ulong factorCount;
+    for (ulong i = position % FACTOR_TABLE_INDEX_INTERVAL; i > 0; i--) {
+        in = decodeVarint(in, end, &factorCount);
+        if (!in || factorCount > MAX_DISTINCT_FACTORS)
+            return FALSE;
+        ulong value;
+        for (ulong j = 0; in && j < 2 * factorCount; j++) {
+            in = decodeVarint(in, end, &value);
+        }
+        if (!in)
+            return FALSE;
+    }
+    in = decodeVarint(in, end, &factorCount);
+    if (!in || factorCount > MAX_DISTINCT_FACTORS)
+        return FALSE;
+    ulong index = 0;
+    for (ulong j = 0; j < factorCount; j++) {
+        ulong delta;
+        in = decodeVarint(in, end, &delta);
+        if (in)
+            in = decodeVarint(in, end, factorCounts + j);
+        if (!in || delta >= table->primeCache.primeCount - index)
+            return FALSE;
+        index += delta;
+        factors[j] = primeCacheGet(&table->primeCache, index);
+    }
+    *outFactorCount = factorCount;
+    return TRUE;
+}
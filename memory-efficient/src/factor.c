@@ -0,0 +1,128 @@
+#include "factor.h"
+#include "montgomery.h"
+#include "primality.h"
+
+// Steps of the rho sequence whose differences are multiplied together before taking one gcd
+#define RHO_BATCH_SIZE 128
+
+static ulong gcd(ulong a, ulong b) {
+    if (a == 0)
+        return b;
+    if (b == 0)
+        return a;
+    uint shift = __builtin_ctzl(a | b);
+    a >>= __builtin_ctzl(a);
+    do {
+        b >>= __builtin_ctzl(b);
+        if (a > b) {
+            ulong t = a;
+            a = b;
+            b = t;
+        }
+        b -= a;
+    } while (b != 0);
+    return a << shift;
+}
+
+static ulong absoluteDifference(ulong a, ulong b) { return a > b ? a - b : b - a; }
+
+static ulong rhoStep(const Montgomery* m, ulong x, ulong c) { return montgomeryAdd(m, montgomeryMultiply(m, x, x), c); }
+
+/** Finds a non-trivial divisor of the odd composite NUMBER with Brent's variant of Pollard's rho.
+ *  Everything stays in Montgomery form: the gcd with NUMBER is unchanged by the factor R, which is coprime to it.
+ */
+static ulong pollardBrent(ulong number) {
+    Montgomery m;
+    montgomeryInit(&m, number);
+    for (ulong increment = 1;; increment++) {
+        ulong c = montgomeryFrom(&m, increment);
+        ulong y = montgomeryFrom(&m, 2);
+        ulong x = y, ys = y;
+        ulong q = m.one;
+        ulong g = 1;
+        for (ulong r = 1; g == 1; r <<= 1) {
+            x = y;
+            for (ulong i = 0; i < r; i++) {
+                y = rhoStep(&m, y, c);
+            }
+            for (ulong k = 0; k < r && g == 1; k += RHO_BATCH_SIZE) {
+                ys = y;
+                ulong steps = r - k < RHO_BATCH_SIZE ? r - k : RHO_BATCH_SIZE;
+                for (ulong i = 0; i < steps; i++) {
+                    y = rhoStep(&m, y, c);
+                    q = montgomeryMultiply(&m, q, absoluteDifference(x, y));
+                }
+                g = gcd(q, number);
+            }
+        }
+        if (g == number) {
+            // The batch overshot, replay it one step at a time
+            do {
+                ys = rhoStep(&m, ys, c);
+                g = gcd(absoluteDifference(x, ys), number);
+            } while (g == 1);
+        }
+        if (g != number)
+            return g;
+    }
+}
+
+static void addFactor(ulong* factors, ulong* factorCounts, ulong* factorCountP, ulong prime, ulong count) {
+    ulong i = *factorCountP;
+    for (ulong j = 0; j < i; j++) {
+        if (factors[j] == prime) {
+            factorCounts[j] += count;
+            return;
+        }
+    }
+    // Insertion keeps the factors sorted
+    while (i > 0 && factors[i - 1] > prime) {
+        factors[i] = factors[i - 1];
+        factorCounts[i] = factorCounts[i - 1];
+        i--;
+    }
+    factors[i] = prime;
+    factorCounts[i] = count;
+    (*factorCountP)++;
+}
+
+/** Decomposes any 64-bit NUMBER without a prime cache.
+ *  Small factors go by trial division, then the cofactor is split with Pollard's rho
+ *  until every part passes the Miller-Rabin test.
+ *  FACTORS and FACTORCOUNTS must hold MAX_DISTINCT_FACTORS entries, they come out sorted by factor.
+ *  @return The number of distinct prime factors, 0 when NUMBER is prime, 0 or 1.
+ */
+ulong factorNumber(ulong number, ulong* factors, ulong* factorCounts) {
+    ulong factorCount = 0;
+    if (number < 4 || isPrime(number))
+        return 0;
+    for (ulong d = 2; d < FACTOR_TRIAL_LIMIT && d * d <= number; d += 1 + (d & 1)) {
+        if (number % d != 0)
+            continue;
+        ulong count = 0;
+        do {
+            number /= d;
+            count++;
+        } while (number % d == 0);
+        addFactor(factors, factorCounts, &factorCount, d, count);
+    }
+    if (number == 1)
+        return factorCount;
+
+    // A 64-bit number has at most 64 prime factors counted with multiplicity
+    ulong pending[64];
+    ulong pendingCount = 0;
+    pending[pendingCount++] = number;
+    while (pendingCount > 0) {
+        ulong n = pending[--pendingCount];
+        if (n < FACTOR_TRIAL_LIMIT * FACTOR_TRIAL_LIMIT || isPrime(n)) {
+            // Trial division left no factor below FACTOR_TRIAL_LIMIT, so n must be prime here
+            addFactor(factors, factorCounts, &factorCount, n, 1);
+            continue;
+        }
+        ulong divisor = pollardBrent(n);
+        pending[pendingCount++] = divisor;
+        pending[pendingCount++] = n / divisor;
+    }
+    return factorCount;
+}
@@ -0,0 +1,110 @@
+#include "format.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char digitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+void outputBufferInit(OutputBuffer* buffer, int fd, size_t capacity) {
+    buffer->fd = fd;
+    buffer->data = malloc(capacity);
+    buffer->length = 0;
+    buffer->capacity = capacity;
+}
+
+void outputBufferDestroy(OutputBuffer* buffer) {
+    outputBufferFlush(buffer);
+    free(buffer->data);
+    buffer->data = NULL;
+}
+
+/** Makes room for SIZE more bytes in BUFFER, growing it if needed. */
+void outputBufferReserve(OutputBuffer* buffer, size_t size) {
+    if (buffer->length + size <= buffer->capacity)
+        return;
+    while (buffer->length + size > buffer->capacity) {
+        buffer->capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, buffer->capacity);
+    if (!buffer->data)
+        err(19, "Could not grow output buffer to %zu bytes", buffer->capacity);
+}
+
+/** Writes out everything in BUFFER with as few write calls as possible. */
+void outputBufferFlush(OutputBuffer* buffer) {
+    size_t written = 0;
+    while (written < buffer->length) {
+        ssize_t result = write(buffer->fd, buffer->data + written, buffer->length - written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            err(6, "Could not write output");
+        }
+        written += result;
+    }
+    buffer->length = 0;
+}
+
+/** Writes the decimal digits of VALUE at OUT, two digits per division.
+ *  @return A pointer right after the last digit.
+ */
+char* formatUnsigned(char* out, ulong value) {
+    char digits[20];
+    char* end = digits + sizeof digits;
+    char* start = end;
+    while (value >= 100) {
+        ulong quotient = value / 100;
+        start -= 2;
+        memcpy(start, digitPairs + 2 * (value - quotient * 100), 2);
+        value = quotient;
+    }
+    if (value >= 10) {
+        start -= 2;
+        memcpy(start, digitPairs + 2 * value, 2);
+    } else {
+        *--start = '0' + value;
+    }
+    memcpy(out, start, end - start);
+    return out + (end - start);
+}
+
+/** Appends the line "number = p^e * q ..." to BUFFER, in the same format the fprintf writer used.
+ *  Nothing is written for numbers without factors.
+ *  The caller must reserve FORMAT_LINE_MAX bytes beforehand.
+ */
+void formatFactorLine(OutputBuffer* buffer, ulong number, const ulong* factors, const ulong* factorCounts,
+                      ulong factorCount) {
+    if (factorCount == 0)
+        return;
+    char* out = buffer->data + buffer->length;
+    out = formatUnsigned(out, number);
+    bool first = TRUE;
+    for (ulong j = 0; j < factorCount; j++) {
+        ulong c = factorCounts[j];
+        if (c == 0)
+            continue;
+        memcpy(out, first ? " = " : " * ", 3);
+        out += 3;
+        first = FALSE;
+        out = formatUnsigned(out, factors[j]);
+        if (c > 1) {
+            *out++ = '^';
+            out = formatUnsigned(out, c);
+        }
+    }
+    *out++ = '\n';
+    buffer->length = out - buffer->data;
+}
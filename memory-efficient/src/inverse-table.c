@@ -0,0 +1,99 @@
+#include "inverse-table.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Entries computed and written at once by inverseTableWrite
+#define INVERSE_WRITE_BATCH 4096
+
+/** Fills ENTRY with the Granlund-Montgomery constants of PRIME.
+ *  2 has no inverse modulo 2^64, its entry is left at zero and callers test it with a shift.
+ */
+void primeInverseCompute(ulong prime, PrimeInverse* entry) {
+    entry->prime = prime;
+    if ((prime & 1) == 0) {
+        entry->inverse = 0;
+        entry->limit = 0;
+        return;
+    }
+    // Each Newton step doubles the number of correct low bits, an odd number is its own inverse mod 8
+    ulong inverse = prime;
+    for (uint i = 0; i < 5; i++) {
+        inverse *= 2 - prime * inverse;
+    }
+    entry->inverse = inverse;
+    entry->limit = -1UL / prime;
+}
+
+/** Writes the inverse table of every prime in PRIMECACHE at PATH, laid out as the entry count followed by the entries.
+ *  Like the prime cache, it is written next to PATH and renamed over it, so runs still mapping the old table keep it.
+ *  @return FALSE if the file could not be written, with errno set.
+ */
+bool inverseTableWrite(const char* path, const PrimeCache* primeCache) {
+    char temporaryPath[PATH_MAX];
+    snprintf(temporaryPath, sizeof temporaryPath, "%s.%d.tmp", path, getpid());
+    FILE* file = fopen(temporaryPath, "wb");
+    if (!file)
+        return FALSE;
+    ulong primeCount = primeCache->primeCount;
+    bool success = fwrite(&primeCount, sizeof primeCount, 1, file) == 1;
+    PrimeInverse batch[INVERSE_WRITE_BATCH];
+    PrimeIterator iterator;
+    primeIteratorSeek(&iterator, primeCache, 0);
+    for (ulong i = 0; success && i < primeCount; i += INVERSE_WRITE_BATCH) {
+        ulong count = primeCount - i < INVERSE_WRITE_BATCH ? primeCount - i : INVERSE_WRITE_BATCH;
+        for (ulong j = 0; j < count && primeIteratorNext(&iterator); j++) {
+            primeInverseCompute(iterator.prime, batch + j);
+        }
+        success = fwrite(batch, sizeof *batch, count, file) == count;
+    }
+    success = fclose(file) == 0 && success;
+    return success && rename(temporaryPath, path) == 0;
+}
+
+/** Maps the inverse table at PATH read-only, the same way as the prime cache.
+ *  @return FALSE if the file could not be opened or mapped, with errno set.
+ */
+bool inverseTableOpen(InverseTable* table, const char* path) {
+    table->fd = open(path, O_RDONLY);
+    if (table->fd < 0)
+        return FALSE;
+    struct stat info;
+    if (fstat(table->fd, &info) < 0) {
+        close(table->fd);
+        return FALSE;
+    }
+    if ((size_t)info.st_size < sizeof(ulong)) {
+        close(table->fd);
+        errno = EINVAL;
+        return FALSE;
+    }
+    table->mappingSize = info.st_size;
+    table->mapping = mmap(NULL, table->mappingSize, PROT_READ, MAP_SHARED, table->fd, 0);
+    if (table->mapping == MAP_FAILED) {
+        close(table->fd);
+        return FALSE;
+    }
+    madvise(table->mapping, table->mappingSize, MADV_WILLNEED);
+
+    const ulong* header = table->mapping;
+    table->count = header[0];
+    table->entries = (const PrimeInverse*)(header + 1);
+    ulong available = (table->mappingSize - sizeof(ulong)) / sizeof(PrimeInverse);
+    if (table->count > available)
+        table->count = available;
+    return TRUE;
+}
+
+void inverseTableClose(InverseTable* table) {
+    munmap(table->mapping, table->mappingSize);
+    close(table->fd);
+    table->mapping = NULL;
+    table->entries = NULL;
+    table->count = 0;
+}
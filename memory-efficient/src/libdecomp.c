@@ -0,0 +1,191 @@
+#include "libdecomp.h"
+#include "darray.h"
+#include "decomposition.h"
+#include "prime-cache.h"
+#include "prime-count.h"
+#include "primes.h"
+#include "sieve.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct decomp_ctx {
+    ulong primeLimit;
+    // Every prime below primeLimit
+    ulong* darrayPrimes;
+    ulong primeCount;
+    ulong threadCount;
+};
+
+/** Decodes the primes below LIMIT from the cache at PATH.
+ *  @return NULL if there is no cache there or it does not cover LIMIT.
+ */
+static ulong* loadPrimes(const char* path, ulong limit) {
+    PrimeCache cache;
+    if (!primeCacheOpen(&cache, path))
+        return NULL;
+    ulong* darrayPrimes = NULL;
+    if (cache.limit >= limit) {
+        darrayPrimes = primeCacheDecode(&cache, limit);
+        // The decoded primes stop at the first one past LIMIT
+        ulong length = darrayLength(darrayPrimes);
+        while (length > 0 && darrayPrimes[length - 1] >= limit) {
+            length--;
+        }
+        darrayResize(&darrayPrimes, length);
+    }
+    primeCacheClose(&cache);
+    return darrayPrimes;
+}
+
+decomp_ctx* decomp_create(uint64_t prime_limit, const char* cache_path, unsigned thread_count) {
+    decomp_ctx* ctx = malloc(sizeof *ctx);
+    if (!ctx)
+        return NULL;
+    ctx->primeLimit = prime_limit;
+    ctx->threadCount = thread_count > 0 ? thread_count : 1;
+    ctx->darrayPrimes = cache_path ? loadPrimes(cache_path, prime_limit) : NULL;
+    if (!ctx->darrayPrimes) {
+        ulong expectedCount = prime_limit > 2 ? exactPrimeCount(prime_limit - 1) : 0;
+        ctx->darrayPrimes = darrayCreate(expectedCount > 0 ? expectedCount : 1, sizeof(ulong));
+        findPrimes(&ctx->darrayPrimes, 0, prime_limit, ctx->threadCount);
+        // A cache that cannot be written only costs the next context a sieve
+        if (cache_path)
+            primeCacheStore(cache_path, NULL, prime_limit, ctx->darrayPrimes, darrayLength(ctx->darrayPrimes));
+    }
+    ctx->primeCount = darrayLength(ctx->darrayPrimes);
+    return ctx;
+}
+
+void decomp_destroy(decomp_ctx* ctx) {
+    if (!ctx)
+        return;
+    darrayDestroy(ctx->darrayPrimes);
+    free(ctx);
+}
+
+uint64_t decomp_prime_limit(const decomp_ctx* ctx) { return ctx->primeLimit; }
+
+/** Copies a decomposition to the caller, giving prime numbers themselves as their factor. */
+static size_t exportFactors(ulong n, const ulong* factors, const ulong* factorCounts, ulong factorCount,
+                            uint64_t* outFactors, uint32_t* outExps) {
+    if (n < 2)
+        return 0;
+    if (factorCount == 0) {
+        outFactors[0] = n;
+        outExps[0] = 1;
+        return 1;
+    }
+    for (ulong i = 0; i < factorCount; i++) {
+        outFactors[i] = factors[i];
+        outExps[i] = factorCounts[i];
+    }
+    return factorCount;
+}
+
+size_t decomp_factor(const decomp_ctx* ctx, uint64_t n, uint64_t* out_factors, uint32_t* out_exps) {
+    ulong factors[MAX_DISTINCT_FACTORS];
+    ulong factorCounts[MAX_DISTINCT_FACTORS];
+    ulong factorCount = trialDecompose(ctx->darrayPrimes, ctx->primeCount, n, factors, factorCounts);
+    return exportFactors(n, factors, factorCounts, factorCount, out_factors, out_exps);
+}
+
+/** Index of the first prime of the table not below NUMBER. */
+static ulong lowerBound(const decomp_ctx* ctx, ulong number) {
+    ulong left = 0, right = ctx->primeCount;
+    while (left < right) {
+        ulong mid = left + (right - left) / 2;
+        if (ctx->darrayPrimes[mid] < number)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    return left;
+}
+
+/** The table itself if it reaches the square root of everything below HIGH, or a new darray of primes that does. */
+static const ulong* basePrimesFor(const decomp_ctx* ctx, ulong high) {
+    ulong root = integerSqrt(high - 1);
+    return root < ctx->primeLimit ? ctx->darrayPrimes : sieveBasePrimes(root + 1);
+}
+
+uint64_t decomp_primes_range(const decomp_ctx* ctx, uint64_t low, uint64_t high, uint64_t* out, size_t capacity) {
+    if (high <= low)
+        return 0;
+    if (high <= ctx->primeLimit) {
+        ulong start = lowerBound(ctx, low);
+        ulong count = lowerBound(ctx, high) - start;
+        memcpy(out, ctx->darrayPrimes + start, (count < capacity ? count : capacity) * sizeof *out);
+        return count;
+    }
+    const ulong* darrayBasePrimes = basePrimesFor(ctx, high);
+    bool* segment = malloc(SIEVE_SEGMENT_SIZE);
+    ulong* darraySegmentPrimes = darrayCreate(SIEVE_SEGMENT_SIZE / 4, sizeof(ulong));
+    ulong total = 0;
+    for (ulong start = low; start < high; start += SIEVE_SEGMENT_SPAN) {
+        ulong end = high - start > SIEVE_SEGMENT_SPAN ? start + SIEVE_SEGMENT_SPAN : high;
+        darrayClear(darraySegmentPrimes);
+        sieveSegment(darrayBasePrimes, start, end, segment, &darraySegmentPrimes);
+        ulong count = darrayLength(darraySegmentPrimes);
+        if (total < capacity)
+            memcpy(out + total, darraySegmentPrimes, (capacity - total < count ? capacity - total : count) * sizeof *out);
+        total += count;
+    }
+    darrayDestroy(darraySegmentPrimes);
+    free(segment);
+    if (darrayBasePrimes != ctx->darrayPrimes)
+        darrayDestroy((ulong*)darrayBasePrimes);
+    return total;
+}
+
+/** What each worker of a range passes the callback. */
+typedef struct {
+    decomp_factor_callback callback;
+    void* user;
+} RangeConsumer;
+
+static int consumeRange(void* context, ulong number, const ulong* factors, const ulong* factorCounts,
+                        ulong factorCount) {
+    RangeConsumer* range = context;
+    uint64_t outFactors[DECOMP_MAX_FACTORS];
+    uint32_t outExps[DECOMP_MAX_FACTORS];
+    size_t count = exportFactors(number, factors, factorCounts, factorCount, outFactors, outExps);
+    return range->callback(number, outFactors, outExps, count, range->user);
+}
+
+/** Runs the block sieve engine over [FIRST, LAST), THREADCOUNT workers each calling CALLBACK with their USERS entry. */
+static int streamRange(const decomp_ctx* ctx, ulong first, ulong last, decomp_factor_callback callback, void** users,
+                       ulong threadCount) {
+    if (last <= first)
+        return 0;
+    RangeConsumer ranges[threadCount];
+    void* contexts[threadCount];
+    for (ulong i = 0; i < threadCount; i++) {
+        ranges[i] = (RangeConsumer){.callback = callback, .user = users ? users[i] : NULL};
+        contexts[i] = ranges + i;
+    }
+    DecompConsumer consumer = {.consume = consumeRange, .threadContexts = contexts};
+    DecompSettings settings = {
+        .firstNumber = first,
+        .lastNumber = last,
+        .threadCount = threadCount,
+        .engine = DECOMP_BLOCK_SIEVE,
+        .darrayBasePrimes = basePrimesFor(ctx, last),
+        .consumer = &consumer,
+    };
+    int result = launchDecomposition(&settings);
+    if (settings.darrayBasePrimes != ctx->darrayPrimes)
+        darrayDestroy((ulong*)settings.darrayBasePrimes);
+    return result;
+}
+
+/** A single worker takes the chunks one after the other, so the numbers come in order. */
+int decomp_factor_range(const decomp_ctx* ctx, uint64_t first, uint64_t last, decomp_factor_callback callback,
+                        void* user) {
+    return streamRange(ctx, first, last, callback, &user, 1);
+}
+
+int decomp_factor_stream(const decomp_ctx* ctx, uint64_t first, uint64_t last, decomp_factor_callback callback,
+                         void** thread_users, unsigned thread_count) {
+    return streamRange(ctx, first, last, callback, thread_users, thread_count > 0 ? thread_count : 1);
+}
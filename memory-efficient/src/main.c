@@ -2,12 +2,24 @@
 #include "primes.h"
 #include "decomposition.h"
 #include "darray.h"
+#include "prime-cache.h"
+#include "prime-count.h"
+#include "factor-table.h"
+#include "factor.h"
+#include "sieve.h"
+#include "perf-counters.h"
+#include "shard.h"
+#include "stats.h"
+#include "trace.h"
 #include "test.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <err.h>
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <unistd.h>
 
 
 static ulong iterCount = 0;
@@ -88,6 +100,184 @@ char *replaceExt(const char* path, const char* ext) {
     }
 }
 
+/** Prints the decomposition of NUMBER read back from the binary factor table. */
+int lookupNumber(ulong number, const char* tablePath, const char* primeListPath) {
+    FactorTable table;
+    if (!factorTableOpen(&table, tablePath, primeListPath)) {
+        perror("Could not open factor table");
+        return 4;
+    }
+    ulong factors[MAX_DISTINCT_FACTORS];
+    ulong factorCounts[MAX_DISTINCT_FACTORS];
+    ulong factorCount;
+    if (!factorTableLookup(&table, number, factors, factorCounts, &factorCount)) {
+        factorTableClose(&table);
+        fprintf(stderr, "%zu is not in the factor table\n", number);
+        return 8;
+    }
+    OutputBuffer buffer;
+    outputBufferInit(&buffer, STDOUT_FILENO, FORMAT_LINE_MAX);
+    formatFactorLine(&buffer, number, factors, factorCounts, factorCount);
+    outputBufferDestroy(&buffer);
+    if (factorCount == 0 && number > 1)
+        printf("%zu is prime\n", number);
+    factorTableClose(&table);
+    return 0;
+}
+
+/** Prints the decomposition of NUMBER, computed on the spot without the prime cache. */
+int decomposeOne(ulong number) {
+    ulong factors[MAX_DISTINCT_FACTORS];
+    ulong factorCounts[MAX_DISTINCT_FACTORS];
+    ulong factorCount = factorNumber(number, factors, factorCounts);
+    OutputBuffer buffer;
+    outputBufferInit(&buffer, STDOUT_FILENO, FORMAT_LINE_MAX);
+    formatFactorLine(&buffer, number, factors, factorCounts, factorCount);
+    outputBufferDestroy(&buffer);
+    if (factorCount == 0 && number > 1)
+        printf("%zu is prime\n", number);
+    return 0;
+}
+
+/** Writes the primes of BASE, then the PRIMECOUNT new ones, to PATH as text.
+ *  The file is written next to PATH and renamed over it, so that it never holds more or less than the cache.
+ *  @return FALSE if the file could not be written, with errno set.
+ */
+static bool writePrimeLiterals(const char* path, const PrimeCache* base, const ulong* primes, ulong primeCount) {
+    char temporaryPath[PATH_MAX];
+    int length = snprintf(temporaryPath, sizeof temporaryPath, "%s.%d.tmp", path, getpid());
+    if (length < 0 || (size_t)length >= sizeof temporaryPath) {
+        errno = ENAMETOOLONG;
+        return FALSE;
+    }
+    FILE* literalFile = fopen(temporaryPath, "w");
+    if (!literalFile)
+        return FALSE;
+    if (base) {
+        PrimeIterator iterator;
+        primeIteratorSeek(&iterator, base, 0);
+        while (primeIteratorNext(&iterator)) {
+            fprintf(literalFile, "%zu\n", iterator.prime);
+        }
+    }
+    for (ulong i = 0; i < primeCount; i++) {
+        fprintf(literalFile, "%zu\n", primes[i]);
+    }
+    if (fclose(literalFile) != 0 || rename(temporaryPath, path) != 0) {
+        remove(temporaryPath);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/** Makes sure the text list, unless PRIMELITERALPATH is NULL, and the binary cache hold every prime below LIMIT.
+ *  A cache that already covers LIMIT is used as is. Otherwise only the primes it misses are sieved, then the
+ *  whole cache and the whole text list are rewritten with the cached primes followed by the new ones.
+ */
+static void computePrimes(ulong limit, ulong threadCount, const char* primeLiteralPath, const char* primeBinaryPath) {
+    PrimeCache primeCache;
+    bool cached = primeCacheOpen(&primeCache, primeBinaryPath);
+    ulong cachedLimit = cached ? primeCache.limit : 0;
+    if (cached && cachedLimit == 0) {
+        // Without a recorded limit, the cache cannot be trusted to be complete
+        primeCacheClose(&primeCache);
+        cached = FALSE;
+    }
+    if (cached && cachedLimit >= limit) {
+        printf("The prime number cache already covers every number below %zu.\n", cachedLimit);
+        primeCacheClose(&primeCache);
+        return;
+    }
+    ulong cachedCount = cached ? primeCache.primeCount : 0;
+    if (cached)
+        printf("Extending the prime number cache from %zu, %zu worker threads...\n", cachedLimit, threadCount);
+    else
+        printf("Counting primes, %zu worker threads...\n", threadCount);
+    // Sized exactly, so putting the segments together never moves the array
+    ulong expectedCount = limit > 2 ? exactPrimeCount(limit - 1) - cachedCount : 0;
+    ulong* darrayPrimes = darrayCreate(expectedCount > 0 ? expectedCount : 1, sizeof(ulong));
+    StatsTimer timer;
+    statsBegin(&timer);
+    findPrimes(&darrayPrimes, cachedLimit, limit, threadCount);
+    statsEnd(STATS_MAIN_THREAD, STATS_SIEVE, &timer);
+
+    ulong primeCount = darrayLength(darrayPrimes);
+
+    printf("\nFound %zu prime numbers.\n", cachedCount + primeCount);
+    PerfCounters counters;
+    perfBegin(&counters);
+    statsBegin(&timer);
+    //We'll map this file during decomposition
+    if (!primeCacheStore(primeBinaryPath, cached ? &primeCache : NULL, limit, darrayPrimes, primeCount))
+        err(5, "Could not write prime number cache %s", primeBinaryPath);
+    // Only once the cache is in place, so that a crash in between never makes the next run write primes twice
+    bool literalsWritten = !primeLiteralPath ||
+                           writePrimeLiterals(primeLiteralPath, cached ? &primeCache : NULL, darrayPrimes, primeCount);
+    if (!literalsWritten)
+        err(5, "Could not write prime number list %s", primeLiteralPath);
+    statsEnd(STATS_MAIN_THREAD, STATS_CACHE_WRITE, &timer);
+    perfEnd(&counters, STATS_MAIN_THREAD, STATS_CACHE_WRITE);
+    if (cached)
+        primeCacheClose(&primeCache);
+    darrayDestroy(darrayPrimes);
+}
+
+static void writeInverseTable(const char* primeBinaryPath, const char* inverseListPath) {
+    PrimeCache primeCache;
+    if (!primeCacheOpen(&primeCache, primeBinaryPath))
+        err(4, "Could not map prime number cache %s", primeBinaryPath);
+    PerfCounters counters;
+    perfBegin(&counters);
+    StatsTimer timer;
+    statsBegin(&timer);
+    if (!inverseTableWrite(inverseListPath, &primeCache))
+        err(5, "Could not write prime inverse table %s", inverseListPath);
+    statsEnd(STATS_MAIN_THREAD, STATS_CACHE_WRITE, &timer);
+    perfEnd(&counters, STATS_MAIN_THREAD, STATS_CACHE_WRITE);
+    primeCacheClose(&primeCache);
+}
+
+/** What each worker of a --summary run tallies, on a cache line of its own. */
+typedef struct {
+    ulong numbers;
+    ulong primes;
+    // Prime factors counted with multiplicity
+    ulong factors;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Summary;
+
+static int summarize(void* context, ulong number, const ulong* factors, const ulong* factorCounts,
+                     ulong factorCount) {
+    (void)factors;
+    Summary* summary = context;
+    summary->numbers++;
+    if (factorCount == 0 && number > 1) {
+        summary->primes++;
+        summary->factors++;
+    }
+    for (ulong i = 0; i < factorCount; i++) {
+        summary->factors += factorCounts[i];
+    }
+    return 0;
+}
+
+/** Reads ARGUMENT as a whole decimal number, and stops with a usage error if it is anything else. */
+static ulong parseNumber(const char* argument, const char* what) {
+    char* end;
+    errno = 0;
+    ulong value = strtoul(argument, &end, 10);
+    // strtoul would take "-1" as the largest number
+    if (end == argument || *end || errno || *argument == '-')
+        errx(-1, "The %s must be a whole number, not '%s'", what, argument);
+    return value;
+}
+
+/** The value following the option at ARGV[*I], which is then skipped. */
+static const char* optionValue(int argc, char** argv, int* i) {
+    if (*i + 1 >= argc)
+        errx(-1, "%s needs a value", argv[*i]);
+    return argv[++*i];
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         err(-1, "You must specify a maximum");
@@ -100,55 +290,193 @@ int main(int argc, char **argv) {
         return performTests(argv[0]);
     }
     if(streq(argv[1], "-s")) {
-        FILE* binaryFile = fopen(primeBinaryPath, "rb");
-        if(!binaryFile) {
-            perror("Could not open prime number cache");
-            return 4;
-        }
-        DecompData data = {
-            .firstNumber = strtoul(argv[2], NULL, 10),
-            .lastNumber = data.firstNumber + 1,
-            .outputFile = stdout,
-            .primeListFile = binaryFile,
-            .tableSize = 1,
-            .threadId = 0,
-        };
-        fread(&data.primeCount, sizeof data.primeCount, 1, binaryFile);
-        decompose(&data);
-        fclose(binaryFile);
+        if (argc < 3)
+            err(-1, "You must specify a number to decompose");
+        return decomposeOne(strtoul(argv[2], NULL, 10));
+    }
+    if(streq(argv[1], "count")) {
+        if (argc < 3)
+            err(-1, "You must specify the upper bound of the count");
+        ulong x = strtoul(argv[2], NULL, 10);
+        printf("pi(%zu) = %zu\n", x, exactPrimeCount(x));
         return 0;
     }
-    ulong limit = strtoul(argv[1], NULL, 10);
+    if(streq(argv[1], "lookup")) {
+        if (argc < 3)
+            err(-1, "You must specify a number to look up");
+        return lookupNumber(strtoul(argv[2], NULL, 10), "output.bin", primeBinaryPath);
+    }
+    if(streq(argv[1], "merge")) {
+        // Either an output followed by the shards, or --check followed by the shards to check only
+        if (argc < 4)
+            err(-1, "You must specify the merged output, or --check, and the shards");
+        const char* mergedPath = streq(argv[2], "--check") ? NULL : argv[2];
+        return shardMerge(mergedPath, argv + 3, argc - 3) ? 0 : 9;
+    }
+    bool sharding = streq(argv[1], "shard");
+    int limitArgument = sharding ? 2 : 1;
+    if (argc <= limitArgument)
+        err(-1, "You must specify a maximum");
+    ulong limit = parseNumber(argv[limitArgument], "maximum");
     ulong threadCount = 1;
-    if (argc > 2) {
-        // Take next argument as the thread count
-        threadCount = strtoul(argv[2], NULL, 10);
+    DecompEngine engine = DECOMP_TRIAL_DIVISION;
+    DecompOutput output = DECOMP_OUTPUT_TEXT;
+    bool resume = FALSE;
+    bool summary = FALSE;
+    ProgressSettings progressSettings = {0};
+    bool stats = FALSE;
+    bool perf = FALSE;
+    const char* tracePath = NULL;
+    const char* statsPath = NULL;
+    ulong first = 0;
+    ulong shardCount = 0;
+    ulong shardIndex = 0;
+    for (int i = limitArgument + 1; i < argc; i++) {
+        if (streq(argv[i], "--from"))
+            first = parseNumber(optionValue(argc, argv, &i), "start of the range");
+        else if (sharding && streq(argv[i], "--shards"))
+            shardCount = parseNumber(optionValue(argc, argv, &i), "shard count");
+        else if (sharding && streq(argv[i], "--index"))
+            shardIndex = parseNumber(optionValue(argc, argv, &i), "shard index");
+        else if (streq(argv[i], "--inverse"))
+            engine = DECOMP_TRIAL_INVERSE;
+        else if (streq(argv[i], "--spf"))
+            engine = DECOMP_SPF_TABLE;
+        else if (streq(argv[i], "--block"))
+            engine = DECOMP_BLOCK_SIEVE;
+        else if (streq(argv[i], "--binary"))
+            output = DECOMP_OUTPUT_BINARY;
+        else if (streq(argv[i], "--resume"))
+            resume = TRUE;
+        else if (streq(argv[i], "--summary"))
+            summary = TRUE;
+        else if (streq(argv[i], "--stats"))
+            stats = TRUE;
+        else if (streq(argv[i], "--trace"))
+            tracePath = optionValue(argc, argv, &i);
+        else if (streq(argv[i], "--perf"))
+            perf = TRUE;
+        else if (streq(argv[i], "--stats-json"))
+            statsPath = optionValue(argc, argv, &i);
+        else if (streq(argv[i], "--headless"))
+            progressSettings.headless = TRUE;
+        else if (streq(argv[i], "--metrics"))
+            progressSettings.metricsPath = optionValue(argc, argv, &i);
+        else if (argv[i][0] == '-')
+            errx(-1, "Unknown option %s", argv[i]);
+        else // Take any other argument as the thread count
+            threadCount = parseNumber(argv[i], "thread count");
     }
-    initProgressReporter(threadCount);
-
-    printf("Counting primes, %zu worker threads...\n", threadCount);
-    ulong* darrayPrimes = darrayCreate(64, sizeof(ulong));
-    findPrimes(&darrayPrimes, limit, threadCount);
-
-    ulong primeCount = darrayLength(darrayPrimes);
+    if (threadCount == 0)
+        errx(-1, "You must run at least one thread");
+    if (first >= limit)
+        err(-1, "The range must start below its end %zu", limit);
+    if (sharding && shardIndex >= shardCount)
+        err(-1, "You must specify --shards and an --index below it");
+    if (sharding && summary)
+        err(-1, "A shard always writes its output, it cannot only be summarized");
+    initProgressReporter(threadCount, &progressSettings);
+    if (stats || statsPath)
+        statsInit(threadCount);
+    if (perf)
+        perfInit(threadCount);
+    if (tracePath)
+        traceInit(threadCount);
 
-    printf("\nFound %zu prime numbers.\n", primeCount);
-    FILE* literalFile = fopen(primeLiteralPath, "w");
-    FILE* binaryFile = fopen(primeBinaryPath, "wb");
-    for (ulong i = 0; i < primeCount; i++) {
-        fprintf(literalFile, "%zu\n", darrayPrimes[i]);
+    // A shard decomposes its slice of the job into a file of its own, named after its index
+    ShardHeader shard;
+    char shardPath[64];
+    const char* outputPath = output == DECOMP_OUTPUT_BINARY ? "output.bin" : "output.txt";
+    ulong windowFirst = first;
+    ulong windowLast = limit;
+    if (sharding) {
+        shardRange(&shard, first, limit, shardCount, shardIndex, output);
+        windowFirst = shard.firstNumber;
+        windowLast = shard.lastNumber;
+        snprintf(shardPath, sizeof shardPath, "output-%zu.%s", shardIndex, SHARD_EXTENSION);
+        outputPath = shardPath;
+        printf("Shard %zu of %zu covers [%zu, %zu).\n", shardIndex, shardCount, windowFirst, windowLast);
     }
-    fwrite(&primeCount, sizeof primeCount, 1, binaryFile);
-    fwrite(darrayPrimes, sizeof(*darrayPrimes), primeCount, binaryFile);
-    fclose(literalFile);
-    fclose(binaryFile); //We'll reopen this file for each thread during decomposition
-    darrayDestroy(darrayPrimes);
+    // A summary writes nothing, so there is nothing to resume either
+    char* checkpointPath = summary ? NULL : replaceExt(outputPath, "ckpt");
+    Checkpoint checkpoint;
+    bool resumed = !summary && resume && checkpointLoad(&checkpoint, checkpointPath);
+    if (resumed && (checkpoint.record.first != windowFirst || checkpoint.record.limit != windowLast ||
+                    checkpoint.record.output != output)) {
+        fprintf(stderr, "The checkpoint %s belongs to another run, starting over.\n", checkpointPath);
+        checkpointDestroy(&checkpoint, FALSE);
+        resumed = FALSE;
+    }
+    if (resumed)
+        printf("Resuming from the checkpoint at %zu.\n", checkpoint.record.nextNumber);
+    else if (!summary)
+        checkpointInit(&checkpoint, checkpointPath, windowFirst, windowLast, output);
+
+    // A window only needs the primes up to the square root of its end, unless the binary table refers to them all.
+    // Every shard of a job sizes the cache the same, so that shards running side by side agree on it.
+    bool window = first > 0 || sharding || summary;
+    ulong primeLimit = window && (summary || output == DECOMP_OUTPUT_TEXT) ? integerSqrt(limit - 1) + 1 : limit;
+    computePrimes(primeLimit, threadCount, sharding ? NULL : primeLiteralPath, primeBinaryPath);
+    char* inverseListPath = replaceExt(primeBinaryPath, INVERSE_TABLE_EXTENSION);
+    if (engine == DECOMP_TRIAL_INVERSE)
+        writeInverseTable(primeBinaryPath, inverseListPath);
 
     printf("Factorizing, %zu worker threads...\n", threadCount);
-    launchDecomposition("./primes.bin", primeCount, limit, "output.txt", threadCount);
+    if (engine == DECOMP_TRIAL_INVERSE)
+        printf("Using the %s divisibility kernel.\n", trialKernelName(trialKernelBestLevel()));
+    if (sharding && !shardBegin(outputPath, &shard))
+        err(5, "Could not write shard %s", outputPath);
+    DecompSettings settings = {
+        .firstNumber = windowFirst,
+        .lastNumber = windowLast,
+        .primeListPath = primeBinaryPath,
+        .inverseListPath = inverseListPath,
+        .outputPath = outputPath,
+        .outputBase = sharding ? sizeof shard : 0,
+        .threadCount = threadCount,
+        .engine = engine,
+        .output = output,
+        .checkpoint = summary ? NULL : &checkpoint,
+    };
+    Summary summaries[threadCount];
+    void* summaryContexts[threadCount];
+    DecompConsumer summaryConsumer = {.consume = summarize, .threadContexts = summaryContexts};
+    if (summary) {
+        for (ulong i = 0; i < threadCount; i++) {
+            summaries[i] = (Summary){0};
+            summaryContexts[i] = summaries + i;
+        }
+        settings.consumer = &summaryConsumer;
+    }
+    launchDecomposition(&settings);
+    if (sharding && !shardSeal(outputPath, &shard))
+        err(5, "Could not seal shard %s", outputPath);
+    if (summary) {
+        Summary total = {0};
+        for (ulong i = 0; i < threadCount; i++) {
+            total.numbers += summaries[i].numbers;
+            total.primes += summaries[i].primes;
+            total.factors += summaries[i].factors;
+        }
+        printf("\n%zu numbers in [%zu, %zu), %zu of them prime, %zu prime factors with multiplicity.",
+               total.numbers, windowFirst, windowLast, total.primes, total.factors);
+    } else {
+        checkpointDestroy(&checkpoint, TRUE);
+    }
+    free(checkpointPath);
+    free(inverseListPath);
     printf("\n");
 
     shutdownProgressReporter();
     printf("\n");
+    statsPrint(stdout);
+    if (statsPath && !statsWriteJson(statsPath))
+        err(5, "Could not write statistics to %s", statsPath);
+    statsShutdown();
+    perfPrint(stdout);
+    perfShutdown();
+    if (tracePath && !traceWrite(tracePath))
+        err(5, "Could not write the trace to %s", tracePath);
+    traceShutdown();
     return 0;
 }
@@ -0,0 +1,129 @@
+#include "ordered-output.h"
+
+#include "darray.h"
+#include "perf-counters.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+// Initial size of a chunk buffer, they grow as needed and are reused afterwards
+#define CHUNK_BUFFER_SIZE (1 << 16)
+
+/** Writes the chunks out strictly in sequence order.
+ *  The lock is only held to look at the slots, never while writing.
+ */
+static void* runWriter(void* input) {
+    OrderedWriter* writer = input;
+    PerfCounters counters;
+    perfBegin(&counters);
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->nextToWrite < writer->chunkCount) {
+        OutputChunk* chunk = writer->slots + writer->nextToWrite % writer->windowSize;
+        if (!chunk->ready) {
+            ulong waitStart = traceNow();
+            while (!chunk->ready) {
+                pthread_cond_wait(&writer->chunkReady, &writer->mutex);
+            }
+            traceRecord(STATS_WRITER_THREAD, TRACE_CHUNK_WAIT, waitStart, writer->nextToWrite, 0);
+        }
+        pthread_mutex_unlock(&writer->mutex);
+
+        ulong markCount = darrayLength(chunk->darrayMarks);
+        for (ulong i = 0; i < markCount; i++) {
+            darrayAdd(&writer->darrayOffsets, writer->bytesWritten + chunk->darrayMarks[i]);
+        }
+        darrayClear(chunk->darrayMarks);
+        StatsTimer timer;
+        statsBegin(&timer);
+        ulong flushStart = traceNow();
+        ulong flushSize = chunk->buffer.length;
+        writer->bytesWritten += chunk->buffer.length;
+        if (writer->checkpoint)
+            checksumUpdate(&writer->checksum, chunk->buffer.data, chunk->buffer.length);
+        outputBufferFlush(&chunk->buffer);
+        if (writer->checkpoint && (writer->nextToWrite + 1 == writer->chunkCount || checkpointDue(writer->checkpoint))) {
+            checkpointRecordOutput(writer->checkpoint, writer->nextToWrite + 1, writer->bytesWritten, &writer->checksum,
+                                   writer->darrayOffsets);
+            checkpointSave(writer->checkpoint, writer->fd);
+        }
+        statsEnd(STATS_WRITER_THREAD, STATS_IO, &timer);
+        traceRecord(STATS_WRITER_THREAD, TRACE_FLUSH, flushStart, writer->nextToWrite, flushSize);
+
+        pthread_mutex_lock(&writer->mutex);
+        chunk->ready = FALSE;
+        writer->nextToWrite++;
+        pthread_cond_broadcast(&writer->slotFree);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    perfEnd(&counters, STATS_WRITER_THREAD, STATS_IO);
+    return NULL;
+}
+
+/** Starts the writer thread for the chunks numbered from FIRSTSEQUENCE up to CHUNKCOUNT.
+ *  At most WINDOWSIZE chunks can be in flight past the last one written,
+ *  which bounds the memory used to reorder them.
+ *  The marks of every chunk end up in darrayOffsets, as offsets in the file.
+ *  With a CHECKPOINT, the writer picks up its checksum and offsets and saves it as the output grows.
+ */
+void orderedWriterStart(OrderedWriter* writer, int fd, ulong firstSequence, ulong chunkCount, ulong windowSize,
+                        Checkpoint* checkpoint) {
+    writer->fd = fd;
+    writer->chunkCount = chunkCount;
+    writer->windowSize = windowSize;
+    writer->nextToWrite = firstSequence;
+    writer->bytesWritten = lseek(fd, 0, SEEK_CUR);
+    writer->darrayOffsets = darrayCreate(64, sizeof(ulong));
+    writer->checkpoint = checkpoint;
+    checksumInit(&writer->checksum);
+    if (checkpoint) {
+        writer->checksum = checkpoint->record.outputChecksum;
+        darrayAppend(&writer->darrayOffsets, checkpoint->darrayIndex, checkpoint->record.indexCount);
+    }
+    writer->slots = malloc(sizeof *writer->slots * windowSize);
+    for (ulong i = 0; i < windowSize; i++) {
+        outputBufferInit(&writer->slots[i].buffer, fd, CHUNK_BUFFER_SIZE);
+        writer->slots[i].darrayMarks = darrayCreate(16, sizeof(ulong));
+        writer->slots[i].ready = FALSE;
+    }
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->chunkReady, NULL);
+    pthread_cond_init(&writer->slotFree, NULL);
+    pthread_create(&writer->writerThread, NULL, runWriter, writer);
+}
+
+/** Waits for every chunk to be written and releases the writer.
+ *  darrayOffsets is left for the caller to destroy.
+ */
+void orderedWriterFinish(OrderedWriter* writer) {
+    pthread_join(writer->writerThread, NULL);
+    for (ulong i = 0; i < writer->windowSize; i++) {
+        outputBufferDestroy(&writer->slots[i].buffer);
+        darrayDestroy(writer->slots[i].darrayMarks);
+    }
+    free(writer->slots);
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->chunkReady);
+    pthread_cond_destroy(&writer->slotFree);
+}
+
+/** Returns the empty buffer chunk SEQUENCE must be formatted into.
+ *  Only blocks when SEQUENCE is a whole window ahead of the writer.
+ */
+OutputChunk* orderedWriterAcquire(OrderedWriter* writer, ulong sequence) {
+    pthread_mutex_lock(&writer->mutex);
+    while (sequence >= writer->nextToWrite + writer->windowSize) {
+        pthread_cond_wait(&writer->slotFree, &writer->mutex);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return &writer->slots[sequence % writer->windowSize];
+}
+
+void orderedWriterSubmit(OrderedWriter* writer, ulong sequence) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->slots[sequence % writer->windowSize].ready = TRUE;
+    if (sequence == writer->nextToWrite)
+        pthread_cond_signal(&writer->chunkReady);
+    pthread_mutex_unlock(&writer->mutex);
+}
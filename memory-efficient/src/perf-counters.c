@@ -0,0 +1,200 @@
+#include "perf-counters.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+bool perfEnabled = FALSE;
+
+/** What one thread counted in each phase, scaled up when the kernel had to multiplex the counters. */
+typedef struct {
+    ulong counts[STATS_PHASE_COUNT][PERF_EVENT_COUNT];
+    bool measured[STATS_PHASE_COUNT];
+} __attribute__((aligned(CACHE_LINE_SIZE))) PerfSlot;
+
+static PerfSlot* slots;
+static ulong s_workerCount;
+// The error the first refused open of each event got, 0 while none was refused
+static atomic_int openErrors[PERF_EVENT_COUNT];
+
+static const char* eventNames[PERF_EVENT_COUNT] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses", "task_clock_ns", "page_faults",
+};
+
+/** The main and writer threads come after the workers, as in the stats. */
+static PerfSlot* perfSlot(ulong threadId) {
+    if (threadId == STATS_MAIN_THREAD)
+        return slots + s_workerCount;
+    if (threadId == STATS_WRITER_THREAD)
+        return slots + s_workerCount + 1;
+    return slots + threadId;
+}
+
+void perfInit(ulong workerCount) {
+    s_workerCount = workerCount;
+    slots = aligned_alloc(CACHE_LINE_SIZE, (workerCount + 2) * sizeof *slots);
+    memset(slots, 0, (workerCount + 2) * sizeof *slots);
+    for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+        atomic_init(&openErrors[e], 0);
+    }
+    perfEnabled = TRUE;
+}
+
+void perfShutdown() {
+    if (!perfEnabled)
+        return;
+    perfEnabled = FALSE;
+    free(slots);
+}
+
+#ifdef __linux__
+
+static void describeEvent(PerfEvent event, struct perf_event_attr* attr) {
+    static const struct {
+        uint type;
+        ulong config;
+    } events[PERF_EVENT_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                 PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                 PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                 PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    };
+    memset(attr, 0, sizeof *attr);
+    attr->size = sizeof *attr;
+    attr->type = events[event].type;
+    attr->config = events[event].config;
+    attr->disabled = 1;
+    // User space only, which perf_event_paranoid allows up to 2
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+}
+
+/** Opens and starts the counters of the calling thread.
+ *  Each event is opened on its own, so that one the machine lacks does not take the others with it.
+ */
+void perfBegin(PerfCounters* counters) {
+    if (!perfEnabled)
+        return;
+    for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+        struct perf_event_attr attr;
+        describeEvent(e, &attr);
+        counters->fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[e] < 0) {
+            int expected = 0;
+            atomic_compare_exchange_strong(&openErrors[e], &expected, errno);
+        }
+    }
+    for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+        if (counters->fds[e] >= 0)
+            ioctl(counters->fds[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/** Stops the counters of the calling thread and adds them to what THREADID counted in PHASE. */
+void perfEnd(PerfCounters* counters, ulong threadId, StatsPhase phase) {
+    if (!perfEnabled)
+        return;
+    for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+        if (counters->fds[e] >= 0)
+            ioctl(counters->fds[e], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    PerfSlot* slot = perfSlot(threadId);
+    for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+        if (counters->fds[e] < 0)
+            continue;
+        ulong values[3];
+        // The value, then how long the counter was enabled and how long it actually ran
+        if (read(counters->fds[e], values, sizeof values) == sizeof values && values[2] > 0)
+            slot->counts[phase][e] += (ulong)((double)values[0] * values[1] / values[2]);
+        close(counters->fds[e]);
+    }
+    slot->measured[phase] = TRUE;
+}
+
+#else
+
+void perfBegin(PerfCounters* counters) {
+    (void)counters;
+    for (ulong e = 0; perfEnabled && e < PERF_EVENT_COUNT; e++) {
+        atomic_store(&openErrors[e], ENOSYS);
+    }
+}
+
+void perfEnd(PerfCounters* counters, ulong threadId, StatsPhase phase) {
+    (void)counters;
+    if (perfEnabled)
+        perfSlot(threadId)->measured[phase] = TRUE;
+}
+
+#endif
+
+static void printRow(FILE* file, const char* label, const ulong* counts) {
+    fprintf(file, "    %-8s", label);
+    for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+        if (atomic_load(&openErrors[e]))
+            fprintf(file, " %14s", "-");
+        else
+            fprintf(file, " %14zu", counts[e]);
+    }
+    if (!atomic_load(&openErrors[PERF_CYCLES]) && !atomic_load(&openErrors[PERF_INSTRUCTIONS]) && counts[PERF_CYCLES])
+        fprintf(file, " %6.2f", (double)counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+    fprintf(file, "\n");
+}
+
+/** Prints the counters of each phase, one row per thread that took part and one for all of them. */
+void perfPrint(FILE* file) {
+    if (!perfEnabled)
+        return;
+    fprintf(file, "Performance counters, user space only:\n");
+    for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+        int error = atomic_load(&openErrors[e]);
+        if (error)
+            fprintf(file, "  %s is not available: %s\n", eventNames[e], strerror(error));
+    }
+    for (ulong p = 0; p < STATS_PHASE_COUNT; p++) {
+        ulong total[PERF_EVENT_COUNT] = {0};
+        bool any = FALSE;
+        for (ulong i = 0; i < s_workerCount + 2; i++) {
+            any |= slots[i].measured[p];
+        }
+        if (!any)
+            continue;
+        fprintf(file, "  %s\n    %-8s", statsPhaseName(p), "thread");
+        for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+            fprintf(file, " %14s", eventNames[e]);
+        }
+        fprintf(file, " %6s\n", "IPC");
+        for (ulong i = 0; i < s_workerCount + 2; i++) {
+            if (!slots[i].measured[p])
+                continue;
+            char label[24];
+            if (i == s_workerCount)
+                snprintf(label, sizeof label, "main");
+            else if (i == s_workerCount + 1)
+                snprintf(label, sizeof label, "writer");
+            else
+                snprintf(label, sizeof label, "%zu", i);
+            printRow(file, label, slots[i].counts[p]);
+            for (ulong e = 0; e < PERF_EVENT_COUNT; e++) {
+                total[e] += slots[i].counts[p][e];
+            }
+        }
+        printRow(file, "all", total);
+    }
+}
@@ -0,0 +1,52 @@
+#include "primality.h"
+#include "montgomery.h"
+
+static const ulong smallPrimes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+
+// With these bases, Miller-Rabin has no strong pseudoprime below 2^64 (Jim Sinclair, 2011).
+static const ulong witnesses[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+
+/** Checks whether NUMBER is a strong probable prime to base WITNESS.
+ *  NUMBER - 1 = D * 2^S, with D odd.
+ */
+static bool isStrongProbablePrime(const Montgomery* m, ulong witness, ulong d, uint s) {
+    ulong a = witness % m->modulus;
+    if (a == 0)
+        return TRUE;
+    ulong minusOne = m->modulus - m->one;
+    ulong x = montgomeryPower(m, montgomeryFrom(m, a), d);
+    if (x == m->one || x == minusOne)
+        return TRUE;
+    for (uint i = 1; i < s; i++) {
+        x = montgomeryMultiply(m, x, x);
+        if (x == minusOne)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/** Deterministic primality test for the whole 64-bit range.
+ *  Small factors are ruled out first, then Miller-Rabin runs on Montgomery arithmetic,
+ *  which needs no 64-bit division and never overflows.
+ */
+bool isPrime(ulong number) {
+    for (uint i = 0; i < sizeof smallPrimes / sizeof *smallPrimes; i++) {
+        if (number == smallPrimes[i])
+            return TRUE;
+        if (number % smallPrimes[i] == 0)
+            return FALSE;
+    }
+    if (number < 41 * 41)
+        return number > 1;
+
+    ulong d = number - 1;
+    uint s = __builtin_ctzl(d);
+    d >>= s;
+    Montgomery m;
+    montgomeryInit(&m, number);
+    for (uint i = 0; i < sizeof witnesses / sizeof *witnesses; i++) {
+        if (!isStrongProbablePrime(&m, witnesses[i], d, s))
+            return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,380 @@
+#include "prime-cache.h"
+#include "darray.h"
+#include "format.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Initial size of the buffer the gaps are encoded into before being written
+#define PRIME_CACHE_WRITE_BUFFER (1 << 16)
+// Longest encoding of a gap: the escape byte and a 10-byte varint
+#define PRIME_CACHE_GAP_MAX 11
+
+static void closeMapping(PrimeCache* cache) {
+    munmap(cache->mapping, cache->mappingSize);
+    close(cache->fd);
+}
+
+static bool openGapCache(PrimeCache* cache, const PrimeCacheHeader* header) {
+    // The seek and the index lookups assume this block size, so any other one is a corrupt file
+    if (header->blockSize != PRIME_CACHE_BLOCK_SIZE || header->indexOffset < sizeof *header ||
+        header->indexOffset > cache->mappingSize)
+        return FALSE;
+    ulong blockCount = (header->primeCount + PRIME_CACHE_BLOCK_SIZE - 1) / PRIME_CACHE_BLOCK_SIZE;
+    if (blockCount > (cache->mappingSize - header->indexOffset) / sizeof(PrimeCacheBlock))
+        return FALSE;
+    cache->gaps = (const uchar*)cache->mapping;
+    cache->blocks = (const PrimeCacheBlock*)(cache->gaps + header->indexOffset);
+    cache->blockCount = blockCount;
+    cache->primeCount = header->primeCount;
+    return TRUE;
+}
+
+/** Maps the prime cache at PATH read-only.
+ *  The mapping is shared between every thread and backed by the page cache,
+ *  so the primes never take heap memory and the kernel can evict them under pressure.
+ *  Every version of the format is read, the primes are then reached through the iterator, primeCacheGet
+ *  or primeCacheIndexOf.
+ *  @return FALSE if the file could not be opened or mapped, with errno set.
+ */
+bool primeCacheOpen(PrimeCache* cache, const char* path) {
+    cache->fd = open(path, O_RDONLY);
+    if (cache->fd < 0)
+        return FALSE;
+    struct stat info;
+    if (fstat(cache->fd, &info) < 0) {
+        close(cache->fd);
+        return FALSE;
+    }
+    if ((size_t)info.st_size < sizeof(ulong)) {
+        close(cache->fd);
+        errno = EINVAL;
+        return FALSE;
+    }
+    cache->mappingSize = info.st_size;
+    cache->mapping = mmap(NULL, cache->mappingSize, PROT_READ, MAP_SHARED, cache->fd, 0);
+    if (cache->mapping == MAP_FAILED) {
+        close(cache->fd);
+        return FALSE;
+    }
+    // Trial division always walks the table from its start, keep it resident
+    madvise(cache->mapping, cache->mappingSize, MADV_WILLNEED);
+
+    cache->primes = NULL;
+    cache->gaps = NULL;
+    cache->blocks = NULL;
+    cache->blockCount = 0;
+    const PrimeCacheHeader* header = cache->mapping;
+    if (cache->mappingSize >= sizeof *header && memcmp(header->magic, PRIME_CACHE_MAGIC, sizeof header->magic) == 0) {
+        cache->version = header->version;
+        cache->limit = header->limit;
+        if (header->version == PRIME_CACHE_VERSION_GAPS) {
+            if (!openGapCache(cache, header)) {
+                closeMapping(cache);
+                errno = EINVAL;
+                return FALSE;
+            }
+            return TRUE;
+        }
+        if (header->version != PRIME_CACHE_VERSION_RAW) {
+            closeMapping(cache);
+            errno = EINVAL;
+            return FALSE;
+        }
+        cache->primeCount = header->primeCount;
+        cache->primes = (const ulong*)(header + 1);
+    } else {
+        // Caches written before the header only start with the prime count, their limit is unknown
+        const ulong* legacy = cache->mapping;
+        cache->version = 0;
+        cache->limit = 0;
+        cache->primeCount = legacy[0];
+        cache->primes = legacy + 1;
+    }
+    ulong available = (cache->mappingSize - ((const char*)cache->primes - (const char*)cache->mapping)) / sizeof(ulong);
+    if (cache->primeCount > available)
+        cache->primeCount = available;
+    return TRUE;
+}
+
+void primeCacheClose(PrimeCache* cache) {
+    closeMapping(cache);
+    cache->mapping = NULL;
+    cache->primes = NULL;
+    cache->gaps = NULL;
+    cache->blocks = NULL;
+    cache->primeCount = 0;
+}
+
+/** Decodes an escaped gap, IN points at its zero byte. */
+ulong primeCacheDecodeLongGap(const uchar** in) {
+    const uchar* bytes = *in + 1;
+    ulong gap = 0;
+    uint shift = 0;
+    while (*bytes & 0x80) {
+        gap |= (ulong)(*bytes++ & 0x7F) << shift;
+        shift += 7;
+    }
+    gap |= (ulong)*bytes++ << shift;
+    *in = bytes;
+    return gap;
+}
+
+static uchar* encodeGap(uchar* out, ulong gap) {
+    if ((gap & 1) == 0 && gap <= 2 * 255) {
+        *out++ = gap / 2;
+        return out;
+    }
+    *out++ = 0;
+    while (gap >= 0x80) {
+        *out++ = (gap & 0x7F) | 0x80;
+        gap >>= 7;
+    }
+    *out++ = gap;
+    return out;
+}
+
+/** Places ITERATOR so that its next step yields the prime at INDEX. */
+void primeIteratorSeek(PrimeIterator* iterator, const PrimeCache* cache, ulong index) {
+    iterator->cache = cache;
+    iterator->prime = 0;
+    if (index >= cache->primeCount) {
+        iterator->index = cache->primeCount;
+        return;
+    }
+    if (cache->primes) {
+        iterator->index = index;
+        iterator->upcoming = cache->primes[index];
+        return;
+    }
+    const PrimeCacheBlock* block = cache->blocks + index / PRIME_CACHE_BLOCK_SIZE;
+    iterator->index = index - index % PRIME_CACHE_BLOCK_SIZE;
+    iterator->upcoming = block->firstPrime;
+    iterator->next = cache->gaps + block->offset;
+    while (iterator->index < index) {
+        primeIteratorNext(iterator);
+    }
+}
+
+ulong primeCacheGet(const PrimeCache* cache, ulong index) {
+    if (cache->primes)
+        return cache->primes[index];
+    PrimeIterator iterator;
+    primeIteratorSeek(&iterator, cache, index);
+    primeIteratorNext(&iterator);
+    return iterator.prime;
+}
+
+/** @return The index of PRIME in the cache, -1 if it is not there. */
+ulong primeCacheIndexOf(const PrimeCache* cache, ulong prime) {
+    ulong count = cache->primes ? cache->primeCount : cache->blockCount;
+    // Last entry not above PRIME, a prime for raw caches and the first prime of a block otherwise
+    ulong left = 0, right = count;
+    while (left < right) {
+        ulong mid = left + (right - left) / 2;
+        ulong value = cache->primes ? cache->primes[mid] : cache->blocks[mid].firstPrime;
+        if (value <= prime)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    if (left == 0)
+        return -1;
+    if (cache->primes)
+        return cache->primes[left - 1] == prime ? left - 1 : -1UL;
+    PrimeIterator iterator;
+    primeIteratorSeek(&iterator, cache, (left - 1) * PRIME_CACHE_BLOCK_SIZE);
+    while (primeIteratorNext(&iterator) && iterator.prime < prime) {
+    }
+    return iterator.prime == prime ? iterator.index - 1 : -1UL;
+}
+
+/** Keeps a checkpoint every PRIME_LOOKUP_STRIDE primes below LIMIT of a gap-compressed CACHE,
+ *  so that primeLookupIndexOf walks a few gaps where primeCacheIndexOf walks half a block on average.
+ */
+void primeLookupInit(PrimeLookup* lookup, const PrimeCache* cache, ulong limit) {
+    lookup->cache = cache;
+    lookup->darrayCheckpoints = NULL;
+    if (cache->primes)
+        return;
+    lookup->darrayCheckpoints = darrayCreate(64, sizeof(PrimeCacheBlock));
+    PrimeIterator iterator;
+    primeIteratorSeek(&iterator, cache, 0);
+    // Between two steps, NEXT points at the gap that follows the upcoming prime, as a block offset does
+    while (iterator.index < cache->primeCount && iterator.upcoming < limit) {
+        if (iterator.index % PRIME_LOOKUP_STRIDE == 0) {
+            PrimeCacheBlock checkpoint = {.firstPrime = iterator.upcoming, .offset = iterator.next - cache->gaps};
+            darrayAdd(&lookup->darrayCheckpoints, checkpoint);
+        }
+        primeIteratorNext(&iterator);
+    }
+}
+
+void primeLookupDestroy(PrimeLookup* lookup) {
+    if (lookup->darrayCheckpoints)
+        darrayDestroy(lookup->darrayCheckpoints);
+    lookup->darrayCheckpoints = NULL;
+}
+
+/** primeCacheIndexOf, for primes below the limit of the lookup.
+ *  @return The index of PRIME, or -1 if it is not a prime.
+ */
+ulong primeLookupIndexOf(const PrimeLookup* lookup, ulong prime) {
+    const PrimeCache* cache = lookup->cache;
+    if (!lookup->darrayCheckpoints)
+        return primeCacheIndexOf(cache, prime);
+    const PrimeCacheBlock* checkpoints = lookup->darrayCheckpoints;
+    ulong left = 0, right = darrayLength(checkpoints);
+    while (left < right) {
+        ulong mid = left + (right - left) / 2;
+        if (checkpoints[mid].firstPrime <= prime)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    if (left == 0)
+        return -1;
+    PrimeIterator iterator = {
+        .cache = cache,
+        .index = (left - 1) * PRIME_LOOKUP_STRIDE,
+        .prime = 0,
+        .upcoming = checkpoints[left - 1].firstPrime,
+        .next = cache->gaps + checkpoints[left - 1].offset,
+    };
+    while (primeIteratorNext(&iterator) && iterator.prime < prime) {
+    }
+    return iterator.prime == prime ? iterator.index - 1 : -1UL;
+}
+
+/** Decodes the primes of the cache up to the first one at or above LIMIT, which is included too.
+ *  Trial division only needs the primes up to a square root: a small prefix of the cache,
+ *  cheaper to decode once than to walk through the gaps for every number.
+ *  @return A darray of primes, to be destroyed by the caller.
+ */
+ulong* primeCacheDecode(const PrimeCache* cache, ulong limit) {
+    ulong* darrayPrimes = darrayCreate(64, sizeof(ulong));
+    PrimeIterator iterator;
+    primeIteratorSeek(&iterator, cache, 0);
+    while (primeIteratorNext(&iterator)) {
+        darrayAdd(&darrayPrimes, iterator.prime);
+        if (iterator.prime >= limit)
+            break;
+    }
+    return darrayPrimes;
+}
+
+/** Writes SIZE bytes of DATA to FD, retrying short writes.
+ *  @return FALSE if the write failed, with errno set.
+ */
+static bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t result = write(fd, data, size);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        data += result;
+        size -= result;
+    }
+    return TRUE;
+}
+
+typedef struct {
+    OutputBuffer buffer;
+    ulong position;
+    ulong count;
+    ulong previous;
+    PrimeCacheBlock* darrayBlocks;
+} GapWriter;
+
+/** Writes out the gaps encoded so far.
+ *  @return FALSE if they could not be written, with errno set.
+ */
+static bool gapWriterFlush(GapWriter* writer) {
+    OutputBuffer* buffer = &writer->buffer;
+    if (!writeAll(buffer->fd, buffer->data, buffer->length))
+        return FALSE;
+    writer->position += buffer->length;
+    buffer->length = 0;
+    return TRUE;
+}
+
+static bool gapWriterAdd(GapWriter* writer, ulong prime) {
+    OutputBuffer* buffer = &writer->buffer;
+    if (writer->count > 0) {
+        outputBufferReserve(buffer, PRIME_CACHE_GAP_MAX);
+        uchar* out = (uchar*)buffer->data + buffer->length;
+        buffer->length = (char*)encodeGap(out, prime - writer->previous) - buffer->data;
+    }
+    if (writer->count % PRIME_CACHE_BLOCK_SIZE == 0) {
+        PrimeCacheBlock block = {.firstPrime = prime, .offset = writer->position + buffer->length};
+        darrayAdd(&writer->darrayBlocks, block);
+    }
+    writer->previous = prime;
+    writer->count++;
+    return buffer->length < PRIME_CACHE_WRITE_BUFFER || gapWriterFlush(writer);
+}
+
+/** Writes a gap-compressed cache at PATH holding the primes of BASE, if any, followed by PRIMES,
+ *  and records that it holds every prime below LIMIT.
+ *  The file is written next to PATH and renamed over it, so a crash leaves the old cache whole.
+ *  BASE may still be mapped from PATH.
+ *  @return FALSE if the file could not be written, with errno set.
+ */
+bool primeCacheStore(const char* path, const PrimeCache* base, ulong limit, const ulong* primes, ulong primeCount) {
+    char temporaryPath[PATH_MAX];
+    // Named after the process, so that concurrent runs sharing the cache never write the same file
+    int length = snprintf(temporaryPath, sizeof temporaryPath, "%s.%d.tmp", path, getpid());
+    if (length < 0 || (size_t)length >= sizeof temporaryPath) {
+        errno = ENAMETOOLONG;
+        return FALSE;
+    }
+    int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return FALSE;
+    GapWriter writer = {.position = sizeof(PrimeCacheHeader), .count = 0, .previous = 0};
+    writer.darrayBlocks = darrayCreate(64, sizeof(PrimeCacheBlock));
+    outputBufferInit(&writer.buffer, fd, PRIME_CACHE_WRITE_BUFFER + PRIME_CACHE_GAP_MAX);
+    bool success = lseek(fd, writer.position, SEEK_SET) >= 0;
+    if (base) {
+        PrimeIterator iterator;
+        primeIteratorSeek(&iterator, base, 0);
+        while (success && primeIteratorNext(&iterator)) {
+            success = gapWriterAdd(&writer, iterator.prime);
+        }
+    }
+    for (ulong i = 0; success && i < primeCount; i++) {
+        success = gapWriterAdd(&writer, primes[i]);
+    }
+    success = success && gapWriterFlush(&writer);
+    free(writer.buffer.data);
+
+    PrimeCacheHeader header = {
+        .version = PRIME_CACHE_VERSION_GAPS,
+        .limit = limit,
+        .primeCount = writer.count,
+        .blockSize = PRIME_CACHE_BLOCK_SIZE,
+        .indexOffset = writer.position,
+    };
+    memcpy(header.magic, PRIME_CACHE_MAGIC, sizeof header.magic);
+    size_t indexSize = darrayLength(writer.darrayBlocks) * sizeof(PrimeCacheBlock);
+    success = success && writeAll(fd, (const char*)writer.darrayBlocks, indexSize) &&
+              pwrite(fd, &header, sizeof header, 0) == sizeof header && fsync(fd) == 0;
+    darrayDestroy(writer.darrayBlocks);
+    success = close(fd) == 0 && success;
+    success = success && rename(temporaryPath, path) == 0;
+    if (!success) {
+        // Keep the errno of the failure, not the one of the cleanup
+        int error = errno;
+        unlink(temporaryPath);
+        errno = error;
+    }
+    return success;
+}
@@ -1,5 +1,8 @@
-#include "defines.h"
+#include "prime-count.h"
+#include "sieve.h"
+
 #include <math.h>
+#include <stdlib.h>
 
 #define LOG_ITER_COUNT 100
 #define LI_ITER_COUNT 10
@@ -55,3 +58,41 @@ ulong approxPrimeCount(ulong limit) {
         return 0;
     return integralLog(limit) * 1.01;
 }
+
+/** Counts the primes up to X, X included, with Lucy_Hedgehog's method in O(X^3/4) time and O(X^1/2) memory.
+ *  S(v) is the count of numbers in [2, v] left after sieving out the multiples of the primes below p.
+ *  Only the values v = X / i are ever needed: the small ones are stored by value, the large ones by i.
+ */
+ulong exactPrimeCount(ulong x) {
+    if (x < 2)
+        return 0;
+    ulong root = integerSqrt(x);
+    ulong* small = malloc(sizeof *small * (root + 1)); // small[v] = S(v)
+    ulong* large = malloc(sizeof *large * (root + 1)); // large[i] = S(x / i)
+    small[0] = 0;
+    for (ulong v = 1; v <= root; v++) {
+        small[v] = v - 1;
+    }
+    for (ulong i = 1; i <= root; i++) {
+        large[i] = x / i - 1;
+    }
+    for (ulong p = 2; p <= root; p++) {
+        if (small[p] == small[p - 1])
+            continue; // p was sieved out, it is not prime
+        ulong primesBelow = small[p - 1];
+        ulong square = p * p;
+        ulong end = x / square < root ? x / square : root;
+        for (ulong i = 1; i <= end; i++) {
+            ulong d = i * p;
+            ulong sieved = d <= root ? large[d] : small[x / d];
+            large[i] -= sieved - primesBelow;
+        }
+        for (ulong v = root; v >= square; v--) {
+            small[v] -= small[v / p] - primesBelow;
+        }
+    }
+    ulong count = large[1];
+    free(small);
+    free(large);
+    return count;
+}
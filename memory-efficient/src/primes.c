@@ -1,136 +1,79 @@
 #include "primes.h"
 #include "progress.h"
 #include "darray.h"
-#include "prime-count.h"
+#include "sieve.h"
+#include "perf-counters.h"
+#include "trace.h"
 
 #include <pthread.h>
-#include <semaphore.h>
-#include <unistd.h>
+#include <stdatomic.h>
+#include <string.h>
 #include <err.h>
 
-static ulong sqr(ulong num) { return num * num; }
-
+typedef struct {
+    ulong threadId;
+    ulong offset;
+    ulong count;
+} SegmentResult;
 
-static pthread_mutex_t tableMutex;
-static sem_t* tableSemaphores;
-static bool* finished;
-static ulong* searchBuffer;
-static ulong* threadProgress;
-static sem_t* arrayAccessSemaphores;
+/** The segments of one call to findPrimes, shared by its workers. */
+typedef struct {
+    atomic_ulong nextSegment;
+    SegmentResult* results;
+} SegmentQueue;
 
 typedef struct {
-    ulong firstNumber;
-    ulong lastNumber;
-    ulong firstIndex;
-    ulong lastIndex;
+    ulong low;
+    ulong limit;
+    ulong segmentCount;
+    const ulong* darrayBasePrimes;
+    ulong* darrayResult;
+    SegmentQueue* queue;
     ulong threadId;
-    ulong threadCount;
 } PrimeData;
 
-static ulong getArrayLength(PrimeData* data) {
-    ulong size = 0;
-    for (size_t i = 0; i < data->threadId; i++) {
-        size += threadProgress[i];
-    }
-    return size;
-}
-
-static ulong getPrimeNumber(PrimeData* data, ulong index) {
-    ulong threadId = data->threadId;
-    ulong i = 0;
-    ulong length;
-    if (data->threadId > 0) {
-        //This is irrelevent in practice somehow, but for safety i leave it here
-        while (searchBuffer[index] == 0) {
-            //sem_wait(arrayAccessSemaphores + data->threadId - 1);
-            usleep(5000000);
-        }
-    }
-    return searchBuffer[index];
-}
-
-static bool hasPotentialFactor(PrimeData* data, ulong index, ulong number, ulong* outFactor) {
-    *outFactor = getPrimeNumber(data, index);
-    return sqr(*outFactor) <= number && *outFactor > 0; 
-}
-
-/** Computes the modular power of BASE to EXP modulo MOD.
- *  @param base The base of the exponentiation
- *  @param exp The exponent
- *  @param mod The modulo
+/** Sieves segments handed out by the shared queue until it runs dry.
+ *  The primes of each segment go at the end of this worker's own result darray,
+ *  the segment result records where they are so they can be put back in order.
  */
-
-static ulong modpow(ulong base, ulong exp, ulong mod) {
-    ulong result = 1;
-    base = base % mod;
-    while (exp > 0) {
-        if(exp & 1)
-            result = (result * base) % mod;
-        exp >>= 1;
-        base = (base * base) % mod;
-    }
-    return result;
-}
-
-static bool fermatTest(PrimeData* data, ulong number) {
-    ulong a = 2;
-    return modpow(a, number - 1, number) == 1;
-}
-
-static bool isPrime(PrimeData* data, ulong number) {
-    if(number == 2)
-        return TRUE;
-    if(!fermatTest(data, number))
-      return FALSE;
-    ulong p;
-    for (ulong j = 0; hasPotentialFactor(data, j, number, &p); j++) {
-        if (number % p == 0) {
-            return FALSE;
-        }
-    }
-    return TRUE;
-}
-
 static void *threadedFindPrimes(void *input) {
     PrimeData* data = input;
-    for (ulong i = data->firstNumber; i < data->lastNumber; i++) {
-        if (isPrime(data, i)) {
-            //sem_wait(arrayAccessSemaphores + data->threadId);
-            searchBuffer[threadProgress[data->threadId]++] = i;
-            //sem_post(arrayAccessSemaphores + data->threadId);
-        }
-        //printBar(i, limit - 1, 30);
-        registerProgress(data->threadId);
+    PerfCounters counters;
+    perfBegin(&counters);
+    bool* segment = malloc(SIEVE_SEGMENT_SIZE);
+    ulong s;
+    while ((s = atomic_fetch_add_explicit(&data->queue->nextSegment, 1, memory_order_relaxed)) < data->segmentCount) {
+        ulong low = data->low + s * SIEVE_SEGMENT_SPAN;
+        ulong high = data->limit - low > SIEVE_SEGMENT_SPAN ? low + SIEVE_SEGMENT_SPAN : data->limit;
+        ulong start = traceNow();
+        ulong offset = darrayLength(data->darrayResult);
+        sieveSegment(data->darrayBasePrimes, low, high, segment, &data->darrayResult);
+        data->queue->results[s] = (SegmentResult){
+            .threadId = data->threadId,
+            .offset = offset,
+            .count = darrayLength(data->darrayResult) - offset,
+        };
+        traceRecord(data->threadId, TRACE_SIEVE_SEGMENT, start, low, high);
+        registerProgressAmount(data->threadId, 1);
     }
-    finished[data->threadId] = TRUE;
+    free(segment);
+    perfEnd(&counters, data->threadId, STATS_SIEVE);
     pthread_exit(NULL);
 }
 
-static void createThreads(pthread_t* threadArray, PrimeData* threadInputs, ulong* searchBuffer, size_t threadCount, ulong searchLimit) {
-    ulong previousLastNumber = 2;
-    size_t iterCount = searchLimit - previousLastNumber;
-    startProgressReport(iterCount);
-    size_t perThread = iterCount / threadCount;
-    size_t surplus = iterCount % threadCount;
-    
+static void createThreads(pthread_t* threadArray, PrimeData* threadInputs, const ulong* darrayBasePrimes,
+                          SegmentQueue* queue, size_t threadCount, ulong low, ulong searchLimit, ulong segmentCount) {
     for (size_t i = 0; i < threadCount; i++) {
-        sem_init(arrayAccessSemaphores + i, 0, 1);
         PrimeData* input = threadInputs + i;
-        input->firstNumber = previousLastNumber;
-        input->lastNumber = input->firstNumber + perThread;
-        if (surplus > 0) {
-            input->lastNumber++;
-            surplus--;
-        }
-        input->firstIndex = approxPrimeCount(previousLastNumber - 1);
-        threadProgress[i] = input->firstIndex;
-        previousLastNumber = input->lastNumber;
-        input->lastIndex = approxPrimeCount(input->lastNumber - 1);
+        input->low = low;
+        input->limit = searchLimit;
+        input->segmentCount = segmentCount;
+        input->darrayBasePrimes = darrayBasePrimes;
+        input->darrayResult = darrayCreate(64, sizeof(ulong));
+        input->queue = queue;
         input->threadId = i;
-        input->threadCount = threadCount;
         pthread_create(&threadArray[i], NULL, threadedFindPrimes, input);
     }
-
 }
 
 static void waitForThreads(pthread_t* threads, size_t threadCount) {
@@ -139,38 +82,50 @@ static void waitForThreads(pthread_t* threads, size_t threadCount) {
     }
 }
 
-static void combineSearchResults(ulong** d_globalArray, ulong* searchBuffer, size_t threadCount, PrimeData* threadInputs) {
-    for(size_t i = 0; i < threadCount; i++) {
-        ulong length = threadProgress[i];
-        for (size_t j = threadInputs[i].firstIndex; j < length; j++) {
-            darrayAdd(d_globalArray, searchBuffer[j]);
-        }
-        sem_destroy(arrayAccessSemaphores + i);
+/** Places every segment at its final position, given by the sum of the counts of the segments before it. */
+static void combineSearchResults(ulong** d_globalArray, size_t threadCount, PrimeData* threadInputs,
+                                 const SegmentResult* segmentResults, ulong segmentCount) {
+    ulong position = darrayLength(*d_globalArray);
+    ulong total = position;
+    for (ulong s = 0; s < segmentCount; s++) {
+        total += segmentResults[s].count;
+    }
+    darrayResize(d_globalArray, total);
+    ulong* globalArray = *d_globalArray;
+    for (ulong s = 0; s < segmentCount; s++) {
+        const SegmentResult* result = segmentResults + s;
+        const ulong* source = threadInputs[result->threadId].darrayResult + result->offset;
+        memcpy(globalArray + position, source, result->count * sizeof *globalArray);
+        position += result->count;
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        darrayDestroy(threadInputs[i].darrayResult);
     }
 }
 
-void findPrimes(ulong **darrayPrimesP, size_t limit, size_t threadCount) {
-    pthread_mutex_init(&tableMutex, NULL);
-    arrayAccessSemaphores = malloc(sizeof *arrayAccessSemaphores * threadCount);
-    finished = calloc(threadCount, sizeof *finished);
-
-    searchBuffer = malloc(sizeof *searchBuffer * approxPrimeCount(limit)); //Buffer containing all prime numbers
-    //Each thread works in a different part of this array
-
-    threadProgress = calloc(threadCount, sizeof *threadProgress);
+/** Appends every prime of [LOW, LIMIT) to the darray pointed to by DARRAYPRIMESP.
+ *  The primes up to the square root of LIMIT are sieved once, then the worker threads
+ *  take cache-sized segments of the range from a shared queue and sieve them independently.
+ */
+void findPrimes(ulong **darrayPrimesP, size_t low, size_t limit, size_t threadCount) {
+    if (limit <= 2 || low >= limit)
+        return;
+    ulong* darrayBasePrimes = sieveBasePrimes(integerSqrt(limit - 1) + 1);
+    ulong segmentCount = (limit - low + SIEVE_SEGMENT_SPAN - 1) / SIEVE_SEGMENT_SPAN;
+    SegmentQueue queue = {.results = malloc(sizeof *queue.results * segmentCount)};
+    atomic_init(&queue.nextSegment, 0);
 
     PrimeData threadInputs[threadCount];
     pthread_t threads[threadCount];
 
-    createThreads(threads, threadInputs, searchBuffer, threadCount, limit);
+    startProgressReport("sieve", segmentCount);
+    createThreads(threads, threadInputs, darrayBasePrimes, &queue, threadCount, low, limit, segmentCount);
 
     waitForThreads(threads, threadCount);
 
-    combineSearchResults(darrayPrimesP, searchBuffer, threadCount, threadInputs);
+    combineSearchResults(darrayPrimesP, threadCount, threadInputs, queue.results, segmentCount);
 
-    free(arrayAccessSemaphores);
-    free(searchBuffer);
-    pthread_mutex_destroy(&tableMutex);
-    free(finished);
+    free(queue.results);
+    darrayDestroy(darrayBasePrimes);
     stopProgressReport();
 }
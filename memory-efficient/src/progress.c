@@ -1,24 +1,62 @@
 #include "progress.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #define REFRESH_INTERVAL 500
+// A worker publishes what it counted one unit at a time every this many units
+#define PROGRESS_BATCH 256
 
 typedef enum { STATUS_WAIT = 0, STATUS_RUN, STATUS_EXIT } ThreadStatus;
 
+/** The counters of one worker, alone on their cache line.
+ *  Only the worker writes them, the reporter reads DONE without any lock.
+ */
+typedef struct {
+    atomic_ulong done;
+    // Counted, but not published yet
+    ulong pending;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ProgressSlot;
+
+static const char* phaseName = "";
 static ulong maxProgress = 0;
-static ulong* iterations;
-static ulong* progress;
+static ProgressSlot* slots;
+// What the reporter saw of each worker at its last refresh, and the speed it got from it
+static ulong* lastDone;
+static ulong* speeds;
+static struct timespec phaseStart;
+static struct timespec lastRefresh;
 static size_t s_threadCount;
 static bool initialized = FALSE;
+static ProgressSettings s_settings;
 
 static pthread_t reportThread;
-static ThreadStatus threadStatus = STATUS_WAIT;
+static _Atomic ThreadStatus threadStatus = STATUS_WAIT;
 static sem_t reportSemaphore;
+// Keeps the reporter and the thread ending a phase from printing at the same time
+static pthread_mutex_t printMutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t dumpRequested = 0;
+
+static double secondsBetween(const struct timespec* from, const struct timespec* to) {
+    return (double)(to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void publish(ProgressSlot* slot) {
+    // The worker is the only writer, so a plain store is enough
+    ulong done = atomic_load_explicit(&slot->done, memory_order_relaxed);
+    atomic_store_explicit(&slot->done, done + slot->pending, memory_order_relaxed);
+    slot->pending = 0;
+}
+
+static ulong doneBy(size_t threadId) { return atomic_load_explicit(&slots[threadId].done, memory_order_relaxed); }
 
 static void printBar(ulong val, ulong max, ulong length) {
     ulong filledPixels = max == 0 ? 0 : (val * length) / max;
@@ -37,31 +75,34 @@ static void printBar(ulong val, ulong max, ulong length) {
 static ulong sumProgress() {
     ulong total = 0;
     for (size_t i = 0; i < s_threadCount; i++) {
-        total += progress[i];
+        total += doneBy(i);
     }
     return total;
 }
 
-static ulong sumIterations() {
+static ulong sumSpeeds() {
     ulong total = 0;
     for (size_t i = 0; i < s_threadCount; i++) {
-        total += iterations[i];
+        total += speeds[i];
     }
     return total;
 }
 
-static void clearArray(ulong *array, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        array[i] = 0;
+/** Measures the speed of each worker since the last refresh. */
+static void refreshSpeeds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = secondsBetween(&lastRefresh, &now);
+    for (size_t i = 0; i < s_threadCount; i++) {
+        ulong done = doneBy(i);
+        speeds[i] = elapsed > 0 ? (ulong)((done - lastDone[i]) / elapsed) : 0;
+        lastDone[i] = done;
     }
-}
-
-static ulong computeSpeed(ulong iterations) {
-    return (ulong)(iterations / (REFRESH_INTERVAL / 1000.0));
+    lastRefresh = now;
 }
 
 static void printProgress(bool firstPrint) {
-    ulong totalSpeed = computeSpeed(sumIterations());
+    ulong totalSpeed = sumSpeeds();
     ulong totalProgress = sumProgress();
     if(s_threadCount > 1) {
         if (!firstPrint)
@@ -76,8 +117,8 @@ static void printProgress(bool firstPrint) {
                 surplus--;
             }
             printf("\e[2K");
-            printBar(progress[i], max, 40);
-            printf(" - %zu iter/s\n", computeSpeed(iterations[i]));
+            printBar(doneBy(i), max, 40);
+            printf(" - %zu iter/s\n", speeds[i]);
         }
         printf("\e[1m");
         printBar(totalProgress, maxProgress, 40);
@@ -89,10 +130,8 @@ static void printProgress(bool firstPrint) {
         printBar(totalProgress, maxProgress, 40);
         printf(" - %zu iter/s", totalSpeed);
     }
-    if (totalSpeed > 0) {
+    if (totalSpeed > 0 && totalProgress <= maxProgress && (maxProgress - totalProgress) / totalSpeed / 60 <= 999) {
         ulong seconds = (maxProgress - totalProgress) / totalSpeed;
-        if(seconds / 60 > 999)
-            printf("%s", " (ETA: --:--)");
         printf(" (ETA: %03zu:%02zu)", seconds / 60, seconds % 60);
     } else {
         printf("%s", " (ETA: --:--)");
@@ -101,65 +140,200 @@ static void printProgress(bool firstPrint) {
     fflush(stdout);
 }
 
-void startProgressReport(ulong max) {
+static void writeMetrics(FILE* file) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(file, "# HELP decomp_phase_info The phase being run, or the last one.\n");
+    fprintf(file, "# TYPE decomp_phase_info gauge\n");
+    fprintf(file, "decomp_phase_info{phase=\"%s\"} 1\n", phaseName);
+    fprintf(file, "# HELP decomp_phase_elapsed_seconds Time since the phase started.\n");
+    fprintf(file, "# TYPE decomp_phase_elapsed_seconds gauge\n");
+    fprintf(file, "decomp_phase_elapsed_seconds %.3f\n", secondsBetween(&phaseStart, &now));
+    fprintf(file, "# HELP decomp_progress_target Units of work in the phase.\n");
+    fprintf(file, "# TYPE decomp_progress_target gauge\n");
+    fprintf(file, "decomp_progress_target %zu\n", maxProgress);
+    fprintf(file, "# HELP decomp_progress_done Units of work each worker did in the phase.\n");
+    fprintf(file, "# TYPE decomp_progress_done gauge\n");
+    for (size_t i = 0; i < s_threadCount; i++) {
+        fprintf(file, "decomp_progress_done{thread=\"%zu\"} %zu\n", i, doneBy(i));
+    }
+    fprintf(file, "# HELP decomp_progress_rate Units of work per second of each worker at the last refresh.\n");
+    fprintf(file, "# TYPE decomp_progress_rate gauge\n");
+    for (size_t i = 0; i < s_threadCount; i++) {
+        fprintf(file, "decomp_progress_rate{thread=\"%zu\"} %zu\n", i, speeds[i]);
+    }
+    fflush(file);
+}
+
+/** Replaces the metrics file at once, so that a scraper never reads half of it. */
+static void saveMetrics() {
+    char temporaryPath[PATH_MAX];
+    int length = snprintf(temporaryPath, sizeof temporaryPath, "%s.%d.tmp", s_settings.metricsPath, getpid());
+    // Missing metrics are not worth stopping the run for
+    if (length < 0 || (size_t)length >= sizeof temporaryPath)
+        return;
+    FILE* file = fopen(temporaryPath, "w");
+    if (!file)
+        return;
+    writeMetrics(file);
+    if (fclose(file) == 0)
+        rename(temporaryPath, s_settings.metricsPath);
+    else
+        remove(temporaryPath);
+}
+
+/** Everything the reporter does at each refresh. Called with the print mutex held. */
+static void refresh() {
+    refreshSpeeds();
+    if (!s_settings.headless)
+        printProgress(FALSE);
+    if (s_settings.metricsPath)
+        saveMetrics();
+}
+
+static void dumpIfRequested() {
+    if (!dumpRequested)
+        return;
+    dumpRequested = 0;
+    writeMetrics(stderr);
+}
+
+/** Sleeps until the next refresh, or until the end of the phase or of the program is posted. */
+static void waitForRefresh() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += REFRESH_INTERVAL * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (sem_timedwait(&reportSemaphore, &deadline) < 0 && errno == EINTR) {
+    }
+}
+
+void startProgressReport(const char* phase, ulong max) {
     if(!initialized)
         return;
+    pthread_mutex_lock(&printMutex);
+    phaseName = phase;
     maxProgress = max;
-    clearArray(progress, s_threadCount);
-    clearArray(iterations, s_threadCount);
+    for (size_t i = 0; i < s_threadCount; i++) {
+        atomic_store_explicit(&slots[i].done, 0, memory_order_relaxed);
+        slots[i].pending = 0;
+        lastDone[i] = 0;
+        speeds[i] = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &phaseStart);
+    lastRefresh = phaseStart;
+    if (!s_settings.headless)
+        printProgress(TRUE);
+    pthread_mutex_unlock(&printMutex);
     threadStatus = STATUS_RUN;
-    printProgress(TRUE);
     sem_post(&reportSemaphore);
 }
 
+/** Ends the phase, once every worker of it has been joined. */
 void stopProgressReport() {
     if(!initialized)
         return;
     threadStatus = STATUS_WAIT;
-    printProgress(FALSE);
+    sem_post(&reportSemaphore);
+    pthread_mutex_lock(&printMutex);
+    // The workers are gone, what they had not published yet can be read from here
+    for (size_t i = 0; i < s_threadCount; i++) {
+        publish(slots + i);
+    }
+    refreshSpeeds();
+    if (s_settings.headless) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = secondsBetween(&phaseStart, &now);
+        ulong total = sumProgress();
+        printf("%s: %zu / %zu in %.3f s, %zu per second\n", phaseName, total, maxProgress, elapsed,
+               elapsed > 0 ? (ulong)(total / elapsed) : 0);
+        fflush(stdout);
+    } else {
+        printProgress(FALSE);
+    }
+    if (s_settings.metricsPath)
+        saveMetrics();
+    pthread_mutex_unlock(&printMutex);
 }
 
 void registerProgress(ulong threadId) {
     if(!initialized)
         return;
-    iterations[threadId]++;
-    progress[threadId]++;
+    ProgressSlot* slot = slots + threadId;
+    if (++slot->pending >= PROGRESS_BATCH)
+        publish(slot);
+}
+
+void registerProgressAmount(ulong threadId, ulong amount) {
+    if(!initialized)
+        return;
+    ProgressSlot* slot = slots + threadId;
+    slot->pending += amount;
+    publish(slot);
 }
 
 static void *reportProgress(void *ptr) {
+    (void)ptr;
     while(threadStatus != STATUS_EXIT) {
         //I use semaphores here instead of condition viariables because
         //most of the time, the condition is signaled before this thread
         //starts waiting for it to be signaled, Thus the progress is not shown at all.
+        //SIGUSR1 posts it too, to get a dump between phases.
         sem_wait(&reportSemaphore);
+        pthread_mutex_lock(&printMutex);
+        dumpIfRequested();
+        pthread_mutex_unlock(&printMutex);
         while (threadStatus == STATUS_RUN) {
-            printProgress(FALSE);
-            clearArray(iterations, s_threadCount);
-            usleep(REFRESH_INTERVAL * 1000);
+            pthread_mutex_lock(&printMutex);
+            if (threadStatus == STATUS_RUN)
+                refresh();
+            dumpIfRequested();
+            pthread_mutex_unlock(&printMutex);
+            waitForRefresh();
         }
     }
     pthread_exit(NULL);
 }
 
-void initProgressReporter(size_t threadCount) {
+/** sem_post is async-signal-safe, the reporter does the actual dump. */
+static void requestDump(int signal) {
+    (void)signal;
+    dumpRequested = 1;
+    sem_post(&reportSemaphore);
+}
+
+void initProgressReporter(size_t threadCount, const ProgressSettings* settings) {
     if(initialized)
         return;
     initialized = TRUE;
     s_threadCount = threadCount;
+    s_settings = *settings;
     threadStatus = STATUS_WAIT;
     sem_init(&reportSemaphore, 0, 0);
-    iterations = calloc(threadCount, sizeof *iterations);
-    progress = calloc(threadCount, sizeof *progress);
+    slots = aligned_alloc(CACHE_LINE_SIZE, threadCount * sizeof *slots);
+    lastDone = calloc(threadCount, sizeof *lastDone);
+    speeds = calloc(threadCount, sizeof *speeds);
+    for (size_t i = 0; i < threadCount; i++) {
+        atomic_init(&slots[i].done, 0);
+        slots[i].pending = 0;
+    }
+    struct sigaction action = {.sa_handler = requestDump, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
     pthread_create(&reportThread, NULL, reportProgress, NULL);
 }
 
 void shutdownProgressReporter() {
     if(!initialized)
         return;
+    signal(SIGUSR1, SIG_DFL);
     threadStatus = STATUS_EXIT;
     sem_post(&reportSemaphore);
     pthread_join(reportThread, NULL);
     sem_destroy(&reportSemaphore);
-    free(iterations);
-    free(progress);
+    free(slots);
+    free(lastDone);
+    free(speeds);
 }
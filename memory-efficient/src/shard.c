@@ -0,0 +1,289 @@
+#include "shard.h"
+#include "decomposition.h"
+#include "factor-table.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bytes moved at once when merging, the shards are streamed through a single buffer of this size
+#define SHARD_COPY_SIZE (1 << 20)
+
+typedef struct {
+    const char* path;
+    int fd;
+    ShardHeader header;
+    // Binary shards only: where the index of the embedded table starts, and where its records went in the output
+    ulong tableIndexOffset;
+    ulong recordsStart;
+} ShardFile;
+
+/** Fills HEADER for slice SHARDINDEX of SHARDCOUNT of [JOBFIRST, JOBLAST), still incomplete.
+ *  Slices are cut on chunk boundaries, so the index intervals of a binary shard line up with those of the whole job.
+ */
+void shardRange(ShardHeader* header, ulong jobFirst, ulong jobLast, ulong shardCount, ulong shardIndex,
+                ulong output) {
+    ulong span = jobLast - jobFirst;
+    ulong chunkCount = (span + DECOMP_CHUNK_SIZE - 1) / DECOMP_CHUNK_SIZE;
+    ulong perShard = chunkCount / shardCount;
+    ulong surplus = chunkCount % shardCount;
+    ulong firstChunk = shardIndex * perShard + (shardIndex < surplus ? shardIndex : surplus);
+    ulong lastChunk = firstChunk + perShard + (shardIndex < surplus ? 1 : 0);
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, SHARD_MAGIC, sizeof header->magic);
+    header->firstNumber = jobFirst + (firstChunk * DECOMP_CHUNK_SIZE < span ? firstChunk * DECOMP_CHUNK_SIZE : span);
+    header->lastNumber = jobFirst + (lastChunk * DECOMP_CHUNK_SIZE < span ? lastChunk * DECOMP_CHUNK_SIZE : span);
+    header->jobFirst = jobFirst;
+    header->jobLast = jobLast;
+    header->shardCount = shardCount;
+    header->shardIndex = shardIndex;
+    header->output = output;
+    checksumInit(&header->payloadChecksum);
+}
+
+/** Writes the incomplete HEADER at the start of the shard at PATH, leaving whatever follows it for a resumed run. */
+bool shardBegin(const char* path, const ShardHeader* header) {
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return FALSE;
+    bool success = pwrite(fd, header, sizeof *header, 0) == sizeof *header;
+    return close(fd) == 0 && success;
+}
+
+/** Marks the shard at PATH complete, recording the size and checksum of everything after HEADER.
+ *  @return FALSE if the file could not be read or written, with errno set.
+ */
+bool shardSeal(const char* path, ShardHeader* header) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return FALSE;
+    struct stat info;
+    bool success = fstat(fd, &info) == 0 && (ulong)info.st_size >= sizeof *header;
+    if (success) {
+        header->payloadSize = info.st_size - sizeof *header;
+        header->sealed = TRUE;
+        success = checksumFile(&header->payloadChecksum, fd, sizeof *header, info.st_size) &&
+                  pwrite(fd, header, sizeof *header, 0) == sizeof *header && fsync(fd) == 0;
+    }
+    return close(fd) == 0 && success;
+}
+
+static bool readFully(int fd, void* data, ulong size, ulong offset) {
+    ulong done = 0;
+    while (done < size) {
+        ssize_t result = pread(fd, (char*)data + done, size - done, offset + done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return FALSE;
+        done += result;
+    }
+    return TRUE;
+}
+
+static bool writeFully(int fd, const void* data, ulong size) {
+    ulong done = 0;
+    while (done < size) {
+        ssize_t result = write(fd, (const char*)data + done, size - done);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return FALSE;
+        done += result;
+    }
+    return TRUE;
+}
+
+static bool openShard(ShardFile* shard, const char* path) {
+    shard->path = path;
+    shard->fd = open(path, O_RDONLY);
+    if (shard->fd < 0) {
+        warn("Could not open shard %s", path);
+        return FALSE;
+    }
+    struct stat info;
+    if (!readFully(shard->fd, &shard->header, sizeof shard->header, 0) ||
+        memcmp(shard->header.magic, SHARD_MAGIC, sizeof shard->header.magic) != 0) {
+        warnx("%s is not a shard file", path);
+        close(shard->fd);
+        return FALSE;
+    }
+    if (!shard->header.sealed || fstat(shard->fd, &info) != 0 ||
+        (ulong)info.st_size != sizeof shard->header + shard->header.payloadSize) {
+        warnx("The shard %s is incomplete", path);
+        close(shard->fd);
+        return FALSE;
+    }
+    posix_fadvise(shard->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return TRUE;
+}
+
+static int compareShards(const void* a, const void* b) {
+    ulong indexA = ((const ShardFile*)a)->header.shardIndex;
+    ulong indexB = ((const ShardFile*)b)->header.shardIndex;
+    return (indexA > indexB) - (indexA < indexB);
+}
+
+/** Sorts SHARDS and checks that they are every slice of the same job, each given once. */
+static bool checkShardSet(ShardFile* shards, ulong shardCount) {
+    qsort(shards, shardCount, sizeof *shards, compareShards);
+    const ShardHeader* job = &shards[0].header;
+    for (ulong i = 0; i < shardCount; i++) {
+        const ShardHeader* header = &shards[i].header;
+        if (header->shardCount != shardCount || header->jobFirst != job->jobFirst || header->jobLast != job->jobLast ||
+            header->output != job->output) {
+            warnx("The shard %s belongs to another job, or not every shard was given", shards[i].path);
+            return FALSE;
+        }
+        if (header->shardIndex != i) {
+            warnx("Shard %zu of %zu is %s", i < header->shardIndex ? i : header->shardIndex, shardCount,
+                  i < header->shardIndex ? "missing" : "given twice");
+            return FALSE;
+        }
+        ulong expectedFirst = i > 0 ? shards[i - 1].header.lastNumber : job->jobFirst;
+        bool lastShard = i + 1 == shardCount;
+        if (header->firstNumber != expectedFirst || (lastShard && header->lastNumber != job->jobLast)) {
+            warnx("The shard %s does not cover the slice of the job it should", shards[i].path);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/** Streams [START, END) of SHARD into CHECKSUM, and into OUTPUTFD unless it is negative. */
+static bool streamShard(const ShardFile* shard, ulong start, ulong end, Checksum* checksum, int outputFd,
+                        char* buffer) {
+    for (ulong position = start; position < end; position += SHARD_COPY_SIZE) {
+        ulong size = end - position < SHARD_COPY_SIZE ? end - position : SHARD_COPY_SIZE;
+        if (!readFully(shard->fd, buffer, size, position)) {
+            warn("Could not read the shard %s", shard->path);
+            return FALSE;
+        }
+        checksumUpdate(checksum, buffer, size);
+        if (outputFd >= 0 && !writeFully(outputFd, buffer, size)) {
+            warn("Could not write the merged output");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/** Checks the payload of SHARD against its checksum, appending it to OUTPUTFD on the way.
+ *  Of a binary shard, only the records are appended: the output has a single table header and index.
+ */
+static bool mergeShard(ShardFile* shard, int outputFd, char* buffer) {
+    ulong start = sizeof shard->header;
+    ulong end = start + shard->header.payloadSize;
+    Checksum checksum;
+    checksumInit(&checksum);
+    bool success;
+    if (shard->header.output == DECOMP_OUTPUT_BINARY) {
+        FactorTableHeader table;
+        if (shard->header.payloadSize < sizeof table || !readFully(shard->fd, &table, sizeof table, start) ||
+            memcmp(table.magic, FACTOR_TABLE_MAGIC, sizeof table.magic) != 0 || table.indexOffset < sizeof table ||
+            table.indexOffset > shard->header.payloadSize) {
+            warnx("The shard %s does not hold a factor table", shard->path);
+            return FALSE;
+        }
+        shard->tableIndexOffset = start + table.indexOffset;
+        shard->recordsStart = outputFd >= 0 ? lseek(outputFd, 0, SEEK_CUR) : 0;
+        success = streamShard(shard, start, start + sizeof table, &checksum, -1, buffer) &&
+                  streamShard(shard, start + sizeof table, shard->tableIndexOffset, &checksum, outputFd, buffer) &&
+                  streamShard(shard, shard->tableIndexOffset, end, &checksum, -1, buffer);
+    } else {
+        success = streamShard(shard, start, end, &checksum, outputFd, buffer);
+    }
+    if (success && !checksumEqual(&checksum, &shard->header.payloadChecksum)) {
+        warnx("The shard %s is damaged, its checksum does not match", shard->path);
+        return FALSE;
+    }
+    return success;
+}
+
+/** Appends the index of the table in SHARD to OUTPUTFD, moved to where its records went. */
+static bool mergeTableIndex(const ShardFile* shard, int outputFd, char* buffer) {
+    ulong end = sizeof shard->header + shard->header.payloadSize;
+    ulong* entries = (ulong*)buffer;
+    for (ulong position = shard->tableIndexOffset; position < end; position += SHARD_COPY_SIZE) {
+        ulong size = end - position < SHARD_COPY_SIZE ? end - position : SHARD_COPY_SIZE;
+        if (!readFully(shard->fd, buffer, size, position)) {
+            warn("Could not read the shard %s", shard->path);
+            return FALSE;
+        }
+        for (ulong i = 0; i < size / sizeof *entries; i++) {
+            entries[i] += shard->recordsStart - sizeof(FactorTableHeader);
+        }
+        if (!writeFully(outputFd, buffer, size)) {
+            warn("Could not write the merged output");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/** Checks the shards at SHARDPATHS and, given an OUTPUTPATH, joins them into the output of their whole job.
+ *  The shards go through a fixed buffer, never into memory whole.
+ *  The output is written next to OUTPUTPATH and only renamed over it once every shard checked out.
+ *  @return FALSE if a shard is missing, damaged or from another job, after saying which.
+ */
+bool shardMerge(const char* outputPath, char** shardPaths, ulong shardCount) {
+    ShardFile* shards = malloc(sizeof *shards * shardCount);
+    ulong openCount = 0;
+    bool success = shardCount > 0;
+    while (success && openCount < shardCount) {
+        success = openShard(shards + openCount, shardPaths[openCount]);
+        if (success)
+            openCount++;
+    }
+    success = success && checkShardSet(shards, shardCount);
+
+    char temporaryPath[PATH_MAX];
+    int outputFd = -1;
+    if (success && outputPath) {
+        snprintf(temporaryPath, sizeof temporaryPath, "%s.%d.tmp", outputPath, getpid());
+        outputFd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFd < 0) {
+            warn("Could not create %s", temporaryPath);
+            success = FALSE;
+        }
+    }
+    const ShardHeader* job = success ? &shards[0].header : NULL;
+    bool binary = success && job->output == DECOMP_OUTPUT_BINARY;
+    if (binary && outputFd >= 0)
+        factorTableWriteHeader(outputFd, 0, job->jobFirst, job->jobLast);
+    char* buffer = malloc(SHARD_COPY_SIZE);
+    for (ulong i = 0; success && i < shardCount; i++) {
+        success = mergeShard(shards + i, outputFd, buffer);
+    }
+    if (success && binary && outputFd >= 0) {
+        ulong indexOffset = lseek(outputFd, 0, SEEK_CUR);
+        for (ulong i = 0; success && i < shardCount; i++) {
+            success = mergeTableIndex(shards + i, outputFd, buffer);
+        }
+        if (success)
+            factorTableSetIndex(outputFd, 0, job->jobFirst, job->jobLast, indexOffset);
+    }
+    free(buffer);
+
+    if (outputFd >= 0) {
+        success = fsync(outputFd) == 0 && success;
+        success = close(outputFd) == 0 && success;
+        if (success && rename(temporaryPath, outputPath) != 0) {
+            warn("Could not write %s", outputPath);
+            success = FALSE;
+        }
+        if (!success)
+            unlink(temporaryPath);
+    }
+    for (ulong i = 0; i < openCount; i++) {
+        close(shards[i].fd);
+    }
+    free(shards);
+    return success;
+}
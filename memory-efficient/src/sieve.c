@@ -0,0 +1,88 @@
+#include "sieve.h"
+#include "darray.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+ulong integerSqrt(ulong num) {
+    if (num < 2)
+        return num;
+    // Start from a power of two above the root, Newton's method then decreases monotonically to the floor.
+    ulong x = 1UL << ((63 - __builtin_clzl(num)) / 2 + 1);
+    ulong y = (x + num / x) >> 1;
+    while (y < x) {
+        x = y;
+        y = (x + num / x) >> 1;
+    }
+    return x;
+}
+
+/** Computes every prime strictly below LIMIT with a plain sieve of Eratosthenes.
+ *  Only meant for the base primes (up to the square root of the real limit).
+ *  @return A darray of primes, to be destroyed by the caller.
+ */
+ulong* sieveBasePrimes(ulong limit) {
+    ulong* darrayPrimes = darrayCreate(64, sizeof(ulong));
+    if (limit <= 2)
+        return darrayPrimes;
+    bool* composite = calloc(limit, sizeof *composite);
+    for (ulong i = 2; i < limit; i++) {
+        if (composite[i])
+            continue;
+        darrayAdd(&darrayPrimes, i);
+        for (ulong j = i * i; j < limit; j += i) {
+            composite[j] = TRUE;
+        }
+    }
+    free(composite);
+    return darrayPrimes;
+}
+
+/** Appends the primes of [LOW, HIGH) to the darray pointed to by DARRAYPRIMESP.
+ *  @param darrayBasePrimes Every prime up to the square root of HIGH - 1
+ *  @param segment Scratch space of at least SIEVE_SEGMENT_SIZE bytes
+ *  HIGH - LOW must not exceed SIEVE_SEGMENT_SPAN.
+ */
+void sieveSegment(const ulong* darrayBasePrimes, ulong low, ulong high, bool* segment, ulong** darrayPrimesP) {
+    if (low <= 2 && high > 2)
+        darrayAdd(darrayPrimesP, 2UL);
+    ulong first = low | 1;
+    if (first < 3)
+        first = 3;
+    if (first >= high)
+        return;
+    // segment[k] stands for the odd number first + 2k
+    ulong length = (high - first + 1) / 2;
+    memset(segment, 0, length);
+
+    ulong baseCount = darrayLength(darrayBasePrimes);
+    for (ulong j = 1; j < baseCount; j++) {
+        ulong p = darrayBasePrimes[j];
+        ulong square = p * p;
+        if (square >= high)
+            break;
+        ulong multiple = square;
+        if (multiple < first) {
+            multiple = (first + p - 1) / p * p;
+            if ((multiple & 1) == 0)
+                multiple += p;
+        }
+        for (ulong k = (multiple - first) / 2; k < length; k += p) {
+            segment[k] = TRUE;
+        }
+    }
+
+    for (ulong k = 0; k < length; k++) {
+        if (!segment[k])
+            darrayAdd(darrayPrimesP, first + 2 * k);
+    }
+}
+
+void sieveRange(const ulong* darrayBasePrimes, ulong low, ulong high, ulong** darrayPrimesP) {
+    bool* segment = malloc(SIEVE_SEGMENT_SIZE);
+    for (ulong start = low; start < high; start += SIEVE_SEGMENT_SPAN) {
+        ulong end = high - start > SIEVE_SEGMENT_SPAN ? start + SIEVE_SEGMENT_SPAN : high;
+        sieveSegment(darrayBasePrimes, start, end, segment, darrayPrimesP);
+    }
+    free(segment);
+}
@@ -0,0 +1,131 @@
+#include "spf.h"
+#include "darray.h"
+#include "progress.h"
+#include "sieve.h"
+#include "perf-counters.h"
+#include "trace.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+typedef struct {
+    SpfTable* table;
+    ulong segmentCount;
+    ulong threadId;
+} SpfData;
+
+static atomic_ulong nextSegment;
+
+/** Fills the entries [first, last) of the table.
+ *  Base primes are visited in increasing order, so the first one to strike
+ *  an odd number is its smallest factor and later ones leave it alone.
+ */
+static void fillSegment(SpfTable* table, ulong first, ulong last) {
+    ushort* entries = table->entries;
+    const ulong* primes = table->darrayBasePrimes;
+    ulong primeCount = darrayLength(primes);
+    ulong high = 2 * last + 1;
+    for (ulong j = 1; j < primeCount; j++) {
+        ulong p = primes[j];
+        ulong square = p * p;
+        if (square >= high)
+            break;
+        ulong multiple = square;
+        if (multiple < 2 * first + 1) {
+            multiple = (2 * first + 1 + p - 1) / p * p;
+            if ((multiple & 1) == 0)
+                multiple += p;
+        }
+        for (ulong k = multiple / 2; k < last; k += p) {
+            if (entries[k] == 0)
+                entries[k] = j;
+        }
+    }
+}
+
+static void* buildSegments(void* input) {
+    SpfData* data = input;
+    PerfCounters counters;
+    perfBegin(&counters);
+    ulong entryCount = (data->table->limit + 1) / 2;
+    ulong s;
+    while ((s = atomic_fetch_add_explicit(&nextSegment, 1, memory_order_relaxed)) < data->segmentCount) {
+        ulong first = s * SPF_SEGMENT_ENTRIES;
+        ulong last = entryCount - first > SPF_SEGMENT_ENTRIES ? first + SPF_SEGMENT_ENTRIES : entryCount;
+        ulong start = traceNow();
+        fillSegment(data->table, first, last);
+        traceRecord(data->threadId, TRACE_SPF_SEGMENT, start, first, last);
+        registerProgressAmount(data->threadId, 1);
+    }
+    perfEnd(&counters, data->threadId, STATS_SPF_TABLE);
+    return NULL;
+}
+
+/** Builds the smallest prime factor table of every number below LIMIT.
+ *  Only odd numbers are stored, and each entry is the 16-bit index of the factor
+ *  among the primes up to sqrt(LIMIT), so the table takes LIMIT bytes.
+ */
+void spfTableBuild(SpfTable* table, ulong limit, size_t threadCount) {
+    table->limit = limit;
+    table->darrayBasePrimes = sieveBasePrimes(integerSqrt(limit) + 1);
+    if (darrayLength(table->darrayBasePrimes) > (ushort)-1)
+        err(18, "Limit %zu is too large for a smallest prime factor table\n", limit);
+
+    ulong entryCount = (limit + 1) / 2;
+    table->entries = calloc(entryCount, sizeof *table->entries);
+    if (!table->entries)
+        err(19, "Could not allocate the smallest prime factor table (%zu entries)\n", entryCount);
+
+    ulong segmentCount = (entryCount + SPF_SEGMENT_ENTRIES - 1) / SPF_SEGMENT_ENTRIES;
+    atomic_store(&nextSegment, 0);
+    SpfData threadInputs[threadCount];
+    pthread_t threads[threadCount];
+    startProgressReport("spf", segmentCount);
+    for (size_t i = 0; i < threadCount; i++) {
+        threadInputs[i] = (SpfData){.table = table, .segmentCount = segmentCount, .threadId = i};
+        pthread_create(&threads[i], NULL, buildSegments, threadInputs + i);
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    stopProgressReport();
+}
+
+void spfTableDestroy(SpfTable* table) {
+    free(table->entries);
+    darrayDestroy(table->darrayBasePrimes);
+    table->entries = NULL;
+    table->darrayBasePrimes = NULL;
+}
+
+/** Decomposes NUMBER by following its chain of smallest prime factors.
+ *  Like the trial division path, prime numbers get no factor at all.
+ */
+void spfDecompose(const SpfTable* table, ulong number, ulong** darrayFactorsP, ulong** darrayFactorCountsP) {
+    if (number < 4 || ((number & 1) && table->entries[number / 2] == 0))
+        return;
+    if ((number & 1) == 0) {
+        ulong twos = __builtin_ctzl(number);
+        number >>= twos;
+        darrayAdd(darrayFactorsP, 2UL);
+        darrayAdd(darrayFactorCountsP, twos);
+    }
+    while (number > 1) {
+        ushort index = table->entries[number / 2];
+        if (index == 0) {
+            darrayAdd(darrayFactorsP, number);
+            darrayAdd(darrayFactorCountsP, 1UL);
+            break;
+        }
+        ulong p = table->darrayBasePrimes[index];
+        ulong count = 0;
+        do {
+            number /= p;
+            count++;
+        } while (number % p == 0);
+        darrayAdd(darrayFactorsP, p);
+        darrayAdd(darrayFactorCountsP, count);
+    }
+}
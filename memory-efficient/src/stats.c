@@ -0,0 +1,182 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+bool statsEnabled = FALSE;
+
+static StatsSlot* slots;
+static ulong s_workerCount;
+static StatsTimer runStart;
+
+static const char* phaseNames[STATS_PHASE_COUNT] = {"sieve", "spf_table", "cache_write", "factorize", "format", "io"};
+
+static ulong nanosecondsNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/** Turns the measures on, for WORKERCOUNT workers numbered from 0 and the main and writer threads. */
+void statsInit(ulong workerCount) {
+    s_workerCount = workerCount;
+    slots = aligned_alloc(CACHE_LINE_SIZE, (workerCount + 2) * sizeof *slots);
+    memset(slots, 0, (workerCount + 2) * sizeof *slots);
+    statsEnabled = TRUE;
+    statsBegin(&runStart);
+}
+
+void statsShutdown() {
+    if (!statsEnabled)
+        return;
+    statsEnabled = FALSE;
+    free(slots);
+}
+
+StatsSlot* statsSlot(ulong threadId) {
+    if (threadId == STATS_MAIN_THREAD)
+        return slots + s_workerCount;
+    if (threadId == STATS_WRITER_THREAD)
+        return slots + s_workerCount + 1;
+    return slots + threadId;
+}
+
+const char* statsPhaseName(StatsPhase phase) { return phaseNames[phase]; }
+
+void statsBegin(StatsTimer* timer) {
+    if (!statsEnabled)
+        return;
+    timer->cycles = statsCycles();
+    timer->nanoseconds = nanosecondsNow();
+}
+
+/** Adds the time since TIMER started to PHASE, as one unit of work of THREADID. */
+void statsEnd(ulong threadId, StatsPhase phase, const StatsTimer* timer) {
+    if (!statsEnabled)
+        return;
+    StatsSlot* slot = statsSlot(threadId);
+    statsAdd(slot, phase, statsCycles() - timer->cycles, 1);
+    slot->nanoseconds[phase] += nanosecondsNow() - timer->nanoseconds;
+}
+
+/** Only called once the threads are done, so the slots can be read without synchronization. */
+static void sumSlots(StatsSlot* total) {
+    memset(total, 0, sizeof *total);
+    for (ulong i = 0; i < s_workerCount + 2; i++) {
+        for (ulong p = 0; p < STATS_PHASE_COUNT; p++) {
+            total->cycles[p] += slots[i].cycles[p];
+            total->nanoseconds[p] += slots[i].nanoseconds[p];
+            total->units[p] += slots[i].units[p];
+        }
+        for (ulong b = 0; b < STATS_BUCKET_COUNT; b++) {
+            total->histogram[b] += slots[i].histogram[b];
+        }
+    }
+}
+
+static double phaseSeconds(const StatsSlot* total, StatsPhase phase, double cyclesPerSecond) {
+    if (total->nanoseconds[phase] > 0)
+        return total->nanoseconds[phase] / 1e9;
+    return cyclesPerSecond > 0 ? total->cycles[phase] / cyclesPerSecond : 0;
+}
+
+static ulong histogramCount(const StatsSlot* total) {
+    ulong count = 0;
+    for (ulong b = 0; b < STATS_BUCKET_COUNT; b++) {
+        count += total->histogram[b];
+    }
+    return count;
+}
+
+/** Upper bound in cycles of the bucket where the fraction Q of the numbers is reached, 0 without any number. */
+static ulong percentileBound(const StatsSlot* total, ulong count, double q) {
+    ulong target = (ulong)(q * count);
+    ulong seen = 0;
+    for (ulong b = 0; b < STATS_BUCKET_COUNT; b++) {
+        seen += total->histogram[b];
+        if (seen > target)
+            return b + 1 < 64 ? 1UL << (b + 1) : (ulong)-1;
+    }
+    return 0;
+}
+
+static ulong maxBound(const StatsSlot* total) {
+    for (ulong b = STATS_BUCKET_COUNT; b > 0; b--) {
+        if (total->histogram[b - 1] > 0)
+            return b < 64 ? 1UL << b : (ulong)-1;
+    }
+    return 0;
+}
+
+void statsPrint(FILE* file) {
+    if (!statsEnabled)
+        return;
+    StatsSlot total;
+    sumSlots(&total);
+    double wallSeconds = (nanosecondsNow() - runStart.nanoseconds) / 1e9;
+    double cyclesPerSecond = wallSeconds > 0 ? (statsCycles() - runStart.cycles) / wallSeconds : 0;
+    fprintf(file, "Run statistics, the cycle counter runs at %.3f GHz:\n", cyclesPerSecond / 1e9);
+    fprintf(file, "  %-12s %12s %20s %12s\n", "phase", "seconds", "cycles", "units");
+    for (ulong p = 0; p < STATS_PHASE_COUNT; p++) {
+        if (total.cycles[p] == 0 && total.units[p] == 0)
+            continue;
+        fprintf(file, "  %-12s %12.3f %20zu %12zu\n", phaseNames[p], phaseSeconds(&total, p, cyclesPerSecond),
+                total.cycles[p], total.units[p]);
+    }
+    fprintf(file, "  %-12s %12.3f\n", "total", wallSeconds);
+    fprintf(file, "factorize and format are summed over the workers, their seconds come from the cycles.\n");
+
+    ulong count = histogramCount(&total);
+    if (count == 0)
+        return;
+    fprintf(file, "Factorization cycles per number, %zu numbers: ", count);
+    fprintf(file, "p50 < %zu, p90 < %zu, p99 < %zu, p99.9 < %zu, max < %zu\n", percentileBound(&total, count, 0.5),
+            percentileBound(&total, count, 0.9), percentileBound(&total, count, 0.99),
+            percentileBound(&total, count, 0.999), maxBound(&total));
+    for (ulong b = 0; b < STATS_BUCKET_COUNT; b++) {
+        if (total.histogram[b] == 0)
+            continue;
+        char range[48];
+        snprintf(range, sizeof range, "[%zu, %zu)", 1UL << b, b + 1 < 64 ? 1UL << (b + 1) : (ulong)-1);
+        fprintf(file, "  %-24s %14zu %7.3f %%\n", range, total.histogram[b], total.histogram[b] * 100.0 / count);
+    }
+}
+
+/** Writes the same figures as statsPrint to PATH as JSON.
+ *  @return FALSE with errno set if the file could not be written.
+ */
+bool statsWriteJson(const char* path) {
+    if (!statsEnabled)
+        return TRUE;
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return FALSE;
+    StatsSlot total;
+    sumSlots(&total);
+    double wallSeconds = (nanosecondsNow() - runStart.nanoseconds) / 1e9;
+    double cyclesPerSecond = wallSeconds > 0 ? (statsCycles() - runStart.cycles) / wallSeconds : 0;
+    fprintf(file, "{\n  \"wall_seconds\": %.6f,\n  \"cycles_per_second\": %.0f,\n  \"workers\": %zu,\n", wallSeconds,
+            cyclesPerSecond, s_workerCount);
+    fprintf(file, "  \"phases\": {");
+    for (ulong p = 0; p < STATS_PHASE_COUNT; p++) {
+        fprintf(file, "%s\n    \"%s\": {\"seconds\": %.6f, \"cycles\": %zu, \"units\": %zu}", p > 0 ? "," : "",
+                phaseNames[p], phaseSeconds(&total, p, cyclesPerSecond), total.cycles[p], total.units[p]);
+    }
+    ulong count = histogramCount(&total);
+    fprintf(file, "\n  },\n  \"factorize_cycles\": {\n    \"count\": %zu,\n", count);
+    fprintf(file, "    \"p50\": %zu,\n    \"p90\": %zu,\n    \"p99\": %zu,\n    \"p999\": %zu,\n    \"max\": %zu,\n",
+            percentileBound(&total, count, 0.5), percentileBound(&total, count, 0.9),
+            percentileBound(&total, count, 0.99), percentileBound(&total, count, 0.999), maxBound(&total));
+    fprintf(file, "    \"buckets\": [");
+    bool firstBucket = TRUE;
+    for (ulong b = 0; b < STATS_BUCKET_COUNT; b++) {
+        if (total.histogram[b] == 0)
+            continue;
+        fprintf(file, "%s\n      {\"low\": %zu, \"high\": %zu, \"count\": %zu}", firstBucket ? "" : ",", 1UL << b,
+                b + 1 < 64 ? 1UL << (b + 1) : (ulong)-1, total.histogram[b]);
+        firstBucket = FALSE;
+    }
+    fprintf(file, "\n    ]\n  }\n}\n");
+    return fclose(file) == 0;
+}
@@ -0,0 +1,145 @@
+#include "trace.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+bool traceEnabled = FALSE;
+
+typedef struct {
+    ulong start;
+    ulong duration;
+    ulong first;
+    ulong second;
+    TraceKind kind;
+} TraceEvent;
+
+/** The ring of one thread. Only that thread writes it, and it is only read once every thread is done. */
+typedef struct {
+    TraceEvent* events;
+    // Every event ever recorded, the ring holds the last TRACE_BUFFER_EVENTS of them
+    ulong recorded;
+} __attribute__((aligned(CACHE_LINE_SIZE))) TraceBuffer;
+
+static TraceBuffer* buffers;
+static ulong s_workerCount;
+static struct timespec origin;
+
+static const struct {
+    const char* name;
+    const char* category;
+    // NULL when the event has no such argument
+    const char* firstArgument;
+    const char* secondArgument;
+} kinds[TRACE_KIND_COUNT] = {
+    {"sieve segment", "sieve", "low", "high"},
+    {"spf segment", "spf", "first", "last"},
+    {"decompose", "decompose", "first", "last"},
+    {"wait for window", "wait", "sequence", NULL},
+    {"submit", "wait", "sequence", NULL},
+    {"wait for chunk", "wait", "sequence", NULL},
+    {"flush", "io", "sequence", "bytes"},
+};
+
+/** Workers first, then the main and writer threads, as in the stats. */
+static ulong bufferIndex(ulong threadId) {
+    if (threadId == STATS_MAIN_THREAD)
+        return s_workerCount;
+    if (threadId == STATS_WRITER_THREAD)
+        return s_workerCount + 1;
+    return threadId;
+}
+
+void traceInit(ulong workerCount) {
+    s_workerCount = workerCount;
+    buffers = aligned_alloc(CACHE_LINE_SIZE, (workerCount + 2) * sizeof *buffers);
+    for (ulong i = 0; i < workerCount + 2; i++) {
+        buffers[i].events = malloc(TRACE_BUFFER_EVENTS * sizeof *buffers[i].events);
+        buffers[i].recorded = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &origin);
+    traceEnabled = TRUE;
+}
+
+void traceShutdown() {
+    if (!traceEnabled)
+        return;
+    traceEnabled = FALSE;
+    for (ulong i = 0; i < s_workerCount + 2; i++) {
+        free(buffers[i].events);
+    }
+    free(buffers);
+}
+
+ulong traceNow() {
+    if (!traceEnabled)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - origin.tv_sec) * 1000000000UL + now.tv_nsec - origin.tv_nsec;
+}
+
+/** Records an event of THREADID that began at START, a traceNow value, and ends now. */
+void traceRecord(ulong threadId, TraceKind kind, ulong start, ulong first, ulong second) {
+    if (!traceEnabled)
+        return;
+    TraceBuffer* buffer = buffers + bufferIndex(threadId);
+    buffer->events[buffer->recorded % TRACE_BUFFER_EVENTS] = (TraceEvent){
+        .start = start,
+        .duration = traceNow() - start,
+        .first = first,
+        .second = second,
+        .kind = kind,
+    };
+    buffer->recorded++;
+}
+
+static void writeThreadName(FILE* file, ulong tid, bool* firstEvent) {
+    char name[32];
+    if (tid == s_workerCount)
+        snprintf(name, sizeof name, "main");
+    else if (tid == s_workerCount + 1)
+        snprintf(name, sizeof name, "writer");
+    else
+        snprintf(name, sizeof name, "worker %zu", tid);
+    fprintf(file, "%s\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"%s\"}}",
+            *firstEvent ? "" : ",", tid, name);
+    *firstEvent = FALSE;
+}
+
+/** Writes every event still in the rings to PATH in the Chrome trace event format, which Perfetto also reads.
+ *  Only called once the traced threads are done.
+ *  @return FALSE with errno set if the file could not be written.
+ */
+bool traceWrite(const char* path) {
+    if (!traceEnabled)
+        return TRUE;
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return FALSE;
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    bool firstEvent = TRUE;
+    for (ulong tid = 0; tid < s_workerCount + 2; tid++) {
+        TraceBuffer* buffer = buffers + tid;
+        if (buffer->recorded == 0)
+            continue;
+        writeThreadName(file, tid, &firstEvent);
+        ulong kept = buffer->recorded < TRACE_BUFFER_EVENTS ? buffer->recorded : TRACE_BUFFER_EVENTS;
+        if (kept < buffer->recorded)
+            fprintf(stderr, "The trace of thread %zu lost its %zu oldest events.\n", tid, buffer->recorded - kept);
+        for (ulong i = buffer->recorded - kept; i < buffer->recorded; i++) {
+            const TraceEvent* event = buffer->events + i % TRACE_BUFFER_EVENTS;
+            fprintf(file, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"cat\": \"%s\", \"pid\": 1, \"tid\": %zu, ",
+                    kinds[event->kind].name, kinds[event->kind].category, tid);
+            fprintf(file, "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"%s\": %zu", event->start / 1e3,
+                    event->duration / 1e3, kinds[event->kind].firstArgument, event->first);
+            if (kinds[event->kind].secondArgument)
+                fprintf(file, ", \"%s\": %zu", kinds[event->kind].secondArgument, event->second);
+            fprintf(file, "}}");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
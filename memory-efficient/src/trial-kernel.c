@@ -0,0 +1,115 @@
+#include "trial-kernel.h"
+
+#include <immintrin.h>
+#include <stdlib.h>
+#include <string.h>
+
+static ulong findDivisorScalar(const TrialKernelTable* table, ulong start, uint number, uint root) {
+    for (ulong j = start;; j++) {
+        if (table->primes[j] > root || number * table->inverses[j] <= table->limits[j])
+            return j;
+    }
+}
+
+__attribute__((target("avx2"))) static ulong findDivisorAvx2(const TrialKernelTable* table, ulong start, uint number,
+                                                              uint root) {
+    __m256i n = _mm256_set1_epi32(number);
+    __m256i r = _mm256_set1_epi32(root);
+    for (ulong j = start;; j += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(table->primes + j));
+        __m256i inverse = _mm256_loadu_si256((const __m256i*)(table->inverses + j));
+        __m256i limit = _mm256_loadu_si256((const __m256i*)(table->limits + j));
+        __m256i quotient = _mm256_mullo_epi32(n, inverse);
+        // AVX2 has no unsigned comparison, a <= b is min(a, b) == a
+        __m256i divisible = _mm256_cmpeq_epi32(_mm256_min_epu32(quotient, limit), quotient);
+        __m256i inRange = _mm256_cmpeq_epi32(_mm256_min_epu32(p, r), p);
+        __m256i stop = _mm256_or_si256(divisible, _mm256_xor_si256(inRange, _mm256_set1_epi32(-1)));
+        uint mask = _mm256_movemask_ps(_mm256_castsi256_ps(stop));
+        if (mask != 0)
+            return j + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx512f"))) static ulong findDivisorAvx512(const TrialKernelTable* table, ulong start,
+                                                                   uint number, uint root) {
+    __m512i n = _mm512_set1_epi32(number);
+    __m512i r = _mm512_set1_epi32(root);
+    for (ulong j = start;; j += 16) {
+        __m512i p = _mm512_loadu_si512(table->primes + j);
+        __m512i inverse = _mm512_loadu_si512(table->inverses + j);
+        __m512i limit = _mm512_loadu_si512(table->limits + j);
+        __m512i quotient = _mm512_mullo_epi32(n, inverse);
+        __mmask16 stop = _mm512_cmple_epu32_mask(quotient, limit) | _mm512_cmpgt_epu32_mask(p, r);
+        if (stop != 0)
+            return j + __builtin_ctz(stop);
+    }
+}
+
+TrialKernelLevel trialKernelBestLevel(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return TRIAL_KERNEL_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return TRIAL_KERNEL_AVX2;
+    return TRIAL_KERNEL_SCALAR;
+}
+
+/** @return The kernel for LEVEL, or NULL if this CPU cannot run it. */
+TrialKernel trialKernelGet(TrialKernelLevel level) {
+    if (level > trialKernelBestLevel())
+        return NULL;
+    switch (level) {
+    case TRIAL_KERNEL_AVX512:
+        return findDivisorAvx512;
+    case TRIAL_KERNEL_AVX2:
+        return findDivisorAvx2;
+    default:
+        return findDivisorScalar;
+    }
+}
+
+const char* trialKernelName(TrialKernelLevel level) {
+    switch (level) {
+    case TRIAL_KERNEL_AVX512:
+        return "avx512";
+    case TRIAL_KERNEL_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+/** Builds the kernel table from the odd primes of ENTRIES and picks the widest kernel this CPU supports.
+ *  The padding entries hold a prime above any root, so every kernel stops there without a bound check.
+ */
+void trialKernelTableInit(TrialKernelTable* table, const PrimeInverse* entries, ulong entryCount) {
+    ulong count = 0;
+    while (count + 1 < entryCount && entries[count + 1].prime < TRIAL_KERNEL_PRIME_LIMIT) {
+        count++;
+    }
+    size_t size = sizeof(uint) * (count + TRIAL_KERNEL_MAX_LANES);
+    table->count = count;
+    table->primes = malloc(size);
+    table->inverses = malloc(size);
+    table->limits = malloc(size);
+    for (ulong j = 0; j < count; j++) {
+        const PrimeInverse* entry = entries + j + 1;
+        table->primes[j] = entry->prime;
+        table->inverses[j] = (uint)entry->inverse;
+        table->limits[j] = 0xFFFFFFFFU / entry->prime;
+    }
+    for (ulong j = count; j < count + TRIAL_KERNEL_MAX_LANES; j++) {
+        table->primes[j] = 0xFFFFFFFFU;
+        table->inverses[j] = 0;
+        table->limits[j] = 0;
+    }
+    table->level = trialKernelBestLevel();
+    table->find = trialKernelGet(table->level);
+}
+
+void trialKernelTableDestroy(TrialKernelTable* table) {
+    free(table->primes);
+    free(table->inverses);
+    free(table->limits);
+    table->count = 0;
+}
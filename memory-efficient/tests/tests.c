@@ -1,8 +1,30 @@
 #include "defines.h"
 #include "test.h"
 #include "prime-count.h"
+#include "sieve.h"
+#include "spf.h"
+#include "block-sieve.h"
+#include "format.h"
+#include "factor-table.h"
+#include "darray.h"
+#include "primality.h"
+#include "factor.h"
+#include "inverse-table.h"
+#include "trial-kernel.h"
+#include "checkpoint.h"
+#include "prime-cache.h"
+#include "shard.h"
+#include "decomposition.h"
+#include "libdecomp.h"
+#include "stats.h"
+#include "perf-counters.h"
+#include "trace.h"
 
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 int log_test() {
     printf("ln(1) == %zu\n", naturalLog(1));
@@ -24,3 +46,669 @@ int li_test() {
         printf("li(10^%zu) == %zu\n", x, approxPrimeCount(power));
     }
 }
+
+int sieve_test() {
+    ulong* darrayBasePrimes = sieveBasePrimes(integerSqrt(99999) + 1);
+    ulong* darrayPrimes = darrayCreate(64, sizeof(ulong));
+    sieveRange(darrayBasePrimes, 0, 100000, &darrayPrimes);
+    ASSERT(darrayLength(darrayPrimes) == 9592);
+    ASSERT(darrayPrimes[0] == 2);
+    ASSERT(darrayPrimes[darrayLength(darrayPrimes) - 1] == 99991);
+    for (ulong i = 1; i < darrayLength(darrayPrimes); i++) {
+        ulong p = darrayPrimes[i];
+        for (ulong j = 0; j < darrayLength(darrayBasePrimes) && darrayBasePrimes[j] * darrayBasePrimes[j] <= p; j++) {
+            ASSERT_MSG(p % darrayBasePrimes[j] != 0, "sieve kept a composite number");
+        }
+    }
+    ASSERT(integerSqrt(0) == 0);
+    ASSERT(integerSqrt(99) == 9);
+    ASSERT(integerSqrt(100) == 10);
+    ASSERT(integerSqrt(-1UL) == 0xFFFFFFFFUL);
+    darrayDestroy(darrayPrimes);
+    darrayDestroy(darrayBasePrimes);
+    return 0;
+}
+
+int spf_test() {
+    SpfTable table;
+    spfTableBuild(&table, 1000, 2);
+    ulong* darrayFactors = darrayCreate(4, sizeof(ulong));
+    ulong* darrayCounts = darrayCreate(4, sizeof(ulong));
+
+    spfDecompose(&table, 360, &darrayFactors, &darrayCounts);
+    ASSERT(darrayLength(darrayFactors) == 3);
+    ASSERT(darrayFactors[0] == 2 && darrayCounts[0] == 3);
+    ASSERT(darrayFactors[1] == 3 && darrayCounts[1] == 2);
+    ASSERT(darrayFactors[2] == 5 && darrayCounts[2] == 1);
+
+    darrayClear(darrayFactors);
+    darrayClear(darrayCounts);
+    spfDecompose(&table, 999, &darrayFactors, &darrayCounts);
+    ASSERT(darrayLength(darrayFactors) == 2);
+    ASSERT(darrayFactors[0] == 3 && darrayCounts[0] == 3);
+    ASSERT(darrayFactors[1] == 37 && darrayCounts[1] == 1);
+
+    darrayClear(darrayFactors);
+    darrayClear(darrayCounts);
+    spfDecompose(&table, 997, &darrayFactors, &darrayCounts);
+    ASSERT_MSG(darrayLength(darrayFactors) == 0, "prime numbers have no decomposition");
+
+    darrayDestroy(darrayFactors);
+    darrayDestroy(darrayCounts);
+    spfTableDestroy(&table);
+    return 0;
+}
+
+int block_sieve_test() {
+    ulong first = 1000000000000UL;
+    ulong* darrayBasePrimes = sieveBasePrimes(integerSqrt(first + 1000) + 1);
+    ulong* darrayFactors = darrayCreate(4, sizeof(ulong));
+    ulong* darrayCounts = darrayCreate(4, sizeof(ulong));
+    FactorBlock block;
+    factorBlockInit(&block);
+    factorBlockSieve(&block, darrayBasePrimes, first, 1000);
+    for (ulong i = 0; i < 1000; i++) {
+        darrayClear(darrayFactors);
+        darrayClear(darrayCounts);
+        factorBlockGet(&block, i, &darrayFactors, &darrayCounts);
+        if (darrayLength(darrayFactors) == 0)
+            continue;
+        ulong product = 1;
+        for (ulong j = 0; j < darrayLength(darrayFactors); j++) {
+            for (ulong c = 0; c < darrayCounts[j]; c++) {
+                product *= darrayFactors[j];
+            }
+        }
+        ASSERT_MSG(product == first + i, "block factors do not multiply back to the number");
+    }
+    // 10^12 + 39 is the first prime above 10^12
+    darrayClear(darrayFactors);
+    darrayClear(darrayCounts);
+    factorBlockGet(&block, 39, &darrayFactors, &darrayCounts);
+    ASSERT(darrayLength(darrayFactors) == 0 && darrayLength(darrayCounts) == 0);
+    factorBlockDestroy(&block);
+    darrayDestroy(darrayFactors);
+    darrayDestroy(darrayCounts);
+    darrayDestroy(darrayBasePrimes);
+    return 0;
+}
+
+int format_test() {
+    char digits[24];
+    *formatUnsigned(digits, 0) = 0;
+    ASSERT(strcmp(digits, "0") == 0);
+    *formatUnsigned(digits, 10) = 0;
+    ASSERT(strcmp(digits, "10") == 0);
+    *formatUnsigned(digits, 12345) = 0;
+    ASSERT(strcmp(digits, "12345") == 0);
+    *formatUnsigned(digits, -1UL) = 0;
+    ASSERT(strcmp(digits, "18446744073709551615") == 0);
+
+    OutputBuffer buffer;
+    outputBufferInit(&buffer, -1, FORMAT_LINE_MAX);
+    ulong factors[] = {2, 3, 5};
+    ulong counts[] = {3, 2, 1};
+    formatFactorLine(&buffer, 360, factors, counts, 3);
+    ASSERT(buffer.length == 20 && memcmp(buffer.data, "360 = 2^3 * 3^2 * 5\n", 20) == 0);
+    formatFactorLine(&buffer, 7, factors, counts, 0);
+    ASSERT_MSG(buffer.length == 20, "numbers without factors are not written");
+    buffer.length = 0;
+    outputBufferDestroy(&buffer);
+    return 0;
+}
+
+int factor_table_test() {
+    const char* primePath = "/tmp/decomp-test-primes.bin";
+    const char* tablePath = "/tmp/decomp-test-table.bin";
+    ulong primes[] = {5, 2, 3, 5, 7, 11};
+    ASSERT(primeCacheStore(primePath, NULL, 12, primes + 1, 5));
+    PrimeCache primeCache;
+    ASSERT(primeCacheOpen(&primeCache, primePath));
+    PrimeLookup primeLookup;
+    primeLookupInit(&primeLookup, &primeCache, 12);
+
+    int fd = open(tablePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    factorTableWriteHeader(fd, 0, 100, 100 + FACTOR_TABLE_INDEX_INTERVAL + 2);
+    OutputBuffer buffer;
+    outputBufferInit(&buffer, fd, FACTOR_TABLE_RECORD_MAX);
+    ulong* darrayIndex = darrayCreate(4, sizeof(ulong));
+    ulong factors[] = {2, 5, 11};
+    ulong counts[] = {2, 1, 3};
+    for (ulong i = 0; i < FACTOR_TABLE_INDEX_INTERVAL + 2; i++) {
+        if (i % FACTOR_TABLE_INDEX_INTERVAL == 0)
+            darrayAdd(&darrayIndex, (ulong)(sizeof(FactorTableHeader) + buffer.length));
+        outputBufferReserve(&buffer, FACTOR_TABLE_RECORD_MAX);
+        factorTableEncode(&buffer, &primeLookup, factors, counts, i % 4);
+    }
+    outputBufferDestroy(&buffer);
+    factorTableWriteIndex(fd, 0, 100, 100 + FACTOR_TABLE_INDEX_INTERVAL + 2, darrayIndex);
+    primeLookupDestroy(&primeLookup);
+    primeCacheClose(&primeCache);
+    darrayDestroy(darrayIndex);
+    close(fd);
+
+    FactorTable table;
+    ASSERT(factorTableOpen(&table, tablePath, primePath));
+    ulong outFactors[MAX_DISTINCT_FACTORS];
+    ulong outCounts[MAX_DISTINCT_FACTORS];
+    ulong factorCount;
+    ASSERT(!factorTableLookup(&table, 99, outFactors, outCounts, &factorCount));
+    ASSERT(factorTableLookup(&table, 100 + FACTOR_TABLE_INDEX_INTERVAL + 1, outFactors, outCounts, &factorCount));
+    ASSERT(factorCount == 1 && outFactors[0] == 2 && outCounts[0] == 2);
+    ASSERT(factorTableLookup(&table, 103, outFactors, outCounts, &factorCount));
+    ASSERT(factorCount == 3 && outFactors[1] == 5 && outFactors[2] == 11 && outCounts[2] == 3);
+    factorTableClose(&table);
+
+    // A corrupt table is rejected instead of being read out of bounds
+    fd = open(tablePath, O_RDWR);
+    FactorTableHeader header;
+    ASSERT(pread(fd, &header, sizeof header, 0) == sizeof header);
+    ASSERT(pwrite(fd, "\x7F", 1, sizeof(FactorTableHeader)) == 1);
+    ASSERT(factorTableOpen(&table, tablePath, primePath));
+    ASSERT(!factorTableLookup(&table, 100, outFactors, outCounts, &factorCount));
+    ASSERT(!factorTableLookup(&table, 101, outFactors, outCounts, &factorCount));
+    factorTableClose(&table);
+    ulong zero = 0;
+    ASSERT(pwrite(fd, &zero, sizeof zero, offsetof(FactorTableHeader, indexInterval)) == sizeof zero);
+    ASSERT(!factorTableOpen(&table, tablePath, primePath));
+    ASSERT(pwrite(fd, &header, sizeof header, 0) == sizeof header);
+    ASSERT(ftruncate(fd, lseek(fd, 0, SEEK_END) - 1) == 0);
+    ASSERT(!factorTableOpen(&table, tablePath, primePath));
+    close(fd);
+    remove(primePath);
+    remove(tablePath);
+    return 0;
+}
+
+int primality_test() {
+    ulong* darrayBasePrimes = sieveBasePrimes(100000);
+    ulong next = 0;
+    for (ulong n = 0; n < 100000; n++) {
+        bool expected = next < darrayLength(darrayBasePrimes) && darrayBasePrimes[next] == n;
+        if (expected)
+            next++;
+        ASSERT_MSG(isPrime(n) == expected, "Miller-Rabin disagrees with the sieve");
+    }
+    darrayDestroy(darrayBasePrimes);
+    // Carmichael numbers and strong pseudoprimes to several of the smaller bases
+    ASSERT(!isPrime(561));
+    ASSERT(!isPrime(2047));
+    ASSERT(!isPrime(3215031751UL));
+    ASSERT(!isPrime(3825123056546413051UL));
+    ASSERT(!isPrime(4294967297UL));
+    ASSERT(!isPrime(4294967291UL * 4294967279UL));
+    ASSERT(!isPrime(-1UL));
+    ASSERT(isPrime(4294967291UL));
+    ASSERT(isPrime((1UL << 61) - 1));
+    ASSERT(isPrime(18446744073709551557UL));
+    return 0;
+}
+
+int factor_test() {
+    ulong factors[MAX_DISTINCT_FACTORS];
+    ulong counts[MAX_DISTINCT_FACTORS];
+    ASSERT(factorNumber(1, factors, counts) == 0);
+    ASSERT(factorNumber(18446744073709551557UL, factors, counts) == 0);
+    ASSERT(factorNumber(4294967291UL * 4294967279UL, factors, counts) == 2);
+    ASSERT(factors[0] == 4294967279UL && factors[1] == 4294967291UL);
+    ASSERT(factorNumber(4294967291UL * 4294967291UL, factors, counts) == 1);
+    ASSERT(factors[0] == 4294967291UL && counts[0] == 2);
+    // Product of the first 15 primes, the most distinct factors a 64-bit number can have
+    ASSERT(factorNumber(614889782588491410UL, factors, counts) == 15);
+    ASSERT(factors[14] == 47);
+    ulong samples[] = {-1UL, 1UL << 63, 999999999999999989UL * 3, 1000003UL * 1000033UL * 1000037UL, 600851475143UL};
+    for (ulong s = 0; s < sizeof samples / sizeof *samples; s++) {
+        ulong factorCount = factorNumber(samples[s], factors, counts);
+        ulong product = 1;
+        for (ulong i = 0; i < factorCount; i++) {
+            ASSERT_MSG(isPrime(factors[i]), "rho left a composite factor");
+            ASSERT(i == 0 || factors[i - 1] < factors[i]);
+            for (ulong e = 0; e < counts[i]; e++) {
+                product *= factors[i];
+            }
+        }
+        ASSERT_MSG(product == samples[s], "factors do not multiply back to the number");
+    }
+    return 0;
+}
+
+int inverse_test() {
+    ulong primes[] = {3, 5, 7, 65521, 4294967291UL};
+    for (ulong i = 0; i < sizeof primes / sizeof *primes; i++) {
+        PrimeInverse entry;
+        primeInverseCompute(primes[i], &entry);
+        ASSERT(entry.prime * entry.inverse == 1);
+        ulong samples[] = {0, 1, primes[i] - 1, primes[i], primes[i] * 12345, primes[i] * 12345 + 1, -1UL, -1UL / primes[i] * primes[i]};
+        for (ulong s = 0; s < sizeof samples / sizeof *samples; s++) {
+            ulong n = samples[s];
+            ulong quotient = n * entry.inverse;
+            ASSERT_MSG((quotient <= entry.limit) == (n % primes[i] == 0), "inverse divisibility test is wrong");
+            ASSERT(quotient > entry.limit || quotient == n / primes[i]);
+        }
+    }
+    return 0;
+}
+
+int trial_kernel_test() {
+    ulong* darrayPrimes = sieveBasePrimes(TRIAL_KERNEL_PRIME_LIMIT);
+    ulong primeCount = darrayLength(darrayPrimes);
+    PrimeInverse* entries = malloc(sizeof *entries * primeCount);
+    for (ulong i = 0; i < primeCount; i++) {
+        primeInverseCompute(darrayPrimes[i], entries + i);
+    }
+    TrialKernelTable table;
+    trialKernelTableInit(&table, entries, primeCount);
+    ASSERT(table.count == primeCount - 1);
+    ASSERT(table.find != NULL);
+    uint samples[] = {9, 25, 3 * 5 * 7 * 11, 65521U * 65519U, 4294967291U, 4294967295U, 1000003U * 7, 65521U * 3};
+    for (TrialKernelLevel level = TRIAL_KERNEL_SCALAR; level <= TRIAL_KERNEL_AVX512; level++) {
+        TrialKernel find = trialKernelGet(level);
+        if (!find)
+            continue;
+        printf("Checking the %s kernel\n", trialKernelName(level));
+        for (ulong s = 0; s < sizeof samples / sizeof *samples; s++) {
+            uint number = samples[s];
+            uint root = integerSqrt(number);
+            for (ulong start = 0; start < 20; start++) {
+                ulong expected = start;
+                while (table.primes[expected] <= root && number % table.primes[expected] != 0) {
+                    expected++;
+                }
+                ASSERT_MSG(find(&table, start, number, root) == expected, "kernel disagrees with plain division");
+            }
+        }
+    }
+    trialKernelTableDestroy(&table);
+    free(entries);
+    darrayDestroy(darrayPrimes);
+    return 0;
+}
+
+int prime_count_test() {
+    ulong* darrayPrimes = sieveBasePrimes(10001);
+    ulong next = 0;
+    for (ulong x = 0; x <= 10000; x++) {
+        while (next < darrayLength(darrayPrimes) && darrayPrimes[next] <= x) {
+            next++;
+        }
+        ASSERT_MSG(exactPrimeCount(x) == next, "pi(x) disagrees with the sieve");
+    }
+    darrayDestroy(darrayPrimes);
+    ASSERT(exactPrimeCount(1000000) == 78498);
+    ASSERT(exactPrimeCount(1000000000) == 50847534);
+    ASSERT(exactPrimeCount(10000000000UL) == 455052511);
+    return 0;
+}
+
+int checksum_test() {
+    uchar data[1000];
+    for (ulong i = 0; i < sizeof data; i++) {
+        data[i] = i * 7 + 3;
+    }
+    Checksum whole;
+    checksumInit(&whole);
+    checksumUpdate(&whole, data, sizeof data);
+    // The checksum must not depend on how the stream is cut
+    ulong cuts[] = {1, 3, 8, 13, 64, 100, 811};
+    for (ulong c = 0; c < sizeof cuts / sizeof *cuts; c++) {
+        Checksum pieces;
+        checksumInit(&pieces);
+        for (ulong offset = 0; offset < sizeof data; offset += cuts[c]) {
+            ulong size = sizeof data - offset < cuts[c] ? sizeof data - offset : cuts[c];
+            checksumUpdate(&pieces, data + offset, size);
+        }
+        ASSERT(checksumEqual(&whole, &pieces));
+    }
+    data[500] ^= 1;
+    Checksum changed;
+    checksumInit(&changed);
+    checksumUpdate(&changed, data, sizeof data);
+    ASSERT(!checksumEqual(&whole, &changed));
+    return 0;
+}
+
+int checkpoint_test() {
+    const char* path = "/tmp/decomp-test.ckpt";
+    Checkpoint checkpoint;
+    checkpointInit(&checkpoint, path, 1000000, 1010000, 0);
+    checkpointResetOutput(&checkpoint, 4096, 0);
+    ASSERT(checkpoint.record.nextNumber == 1000000);
+    Checksum checksum;
+    checksumInit(&checksum);
+    ulong* darrayIndex = darrayCreate(4, sizeof(ulong));
+    darrayAdd(&darrayIndex, 0UL);
+    darrayAdd(&darrayIndex, 1234UL);
+    checkpointRecordOutput(&checkpoint, 2, 5678, &checksum, darrayIndex);
+    // Chunks count from the start of the window, and the last one stops at its end
+    ASSERT(checkpoint.record.nextNumber == 1008192);
+    checkpointRecordOutput(&checkpoint, 3, 5678, &checksum, darrayIndex);
+    ASSERT(checkpoint.record.nextNumber == 1010000);
+    checkpointSave(&checkpoint, -1);
+    checkpointDestroy(&checkpoint, FALSE);
+
+    ASSERT(checkpointLoad(&checkpoint, path));
+    ASSERT(checkpoint.record.first == 1000000 && checkpoint.record.limit == 1010000);
+    ASSERT(checkpoint.record.indexCount == 2 && checkpoint.darrayIndex[1] == 1234);
+    checkpointDestroy(&checkpoint, TRUE);
+    darrayDestroy(darrayIndex);
+    return 0;
+}
+
+int prime_cache_test() {
+    const char* path = "/tmp/decomp-test-cache.bin";
+    ulong* darrayBasePrimes = sieveBasePrimes(1000);
+    ulong* darrayLow = darrayCreate(64, sizeof(ulong));
+    ulong* darrayHigh = darrayCreate(64, sizeof(ulong));
+    sieveRange(darrayBasePrimes, 0, 10000, &darrayLow);
+    sieveRange(darrayBasePrimes, 10000, 1000000, &darrayHigh);
+    ASSERT(primeCacheStore(path, NULL, 10000, darrayLow, darrayLength(darrayLow)));
+
+    PrimeCache cache;
+    ASSERT(primeCacheOpen(&cache, path));
+    ASSERT(cache.version == PRIME_CACHE_VERSION_GAPS);
+    ASSERT(cache.limit == 10000 && cache.primeCount == 1229);
+    // Extending keeps the primes already there, the cache is rewritten while still mapped
+    ASSERT(primeCacheStore(path, &cache, 1000000, darrayHigh, darrayLength(darrayHigh)));
+    primeCacheClose(&cache);
+
+    ASSERT(primeCacheOpen(&cache, path));
+    ASSERT(cache.limit == 1000000 && cache.primeCount == 78498);
+    ASSERT_MSG(cache.mappingSize < 78498 * 2, "the gaps should take about a byte per prime");
+    PrimeIterator iterator;
+    primeIteratorSeek(&iterator, &cache, 0);
+    for (ulong i = 0; i < cache.primeCount; i++) {
+        ASSERT(primeIteratorNext(&iterator));
+        ulong expected = i < 1229 ? darrayLow[i] : darrayHigh[i - 1229];
+        ASSERT_MSG(iterator.prime == expected, "the iterator lost track of the primes");
+    }
+    ASSERT(!primeIteratorNext(&iterator));
+    PrimeLookup lookup;
+    primeLookupInit(&lookup, &cache, 1000000);
+    ulong samples[] = {0, 1, 31, 32, 33, 1023, 1024, 1025, 1228, 1229, 50000, 78497};
+    for (ulong s = 0; s < sizeof samples / sizeof *samples; s++) {
+        ulong i = samples[s];
+        ulong expected = i < 1229 ? darrayLow[i] : darrayHigh[i - 1229];
+        ASSERT(primeCacheGet(&cache, i) == expected);
+        ASSERT(primeCacheIndexOf(&cache, expected) == i);
+        ASSERT(expected == 2 || primeCacheIndexOf(&cache, expected + 1) == -1UL);
+        ASSERT_MSG(primeLookupIndexOf(&lookup, expected) == i, "the lookup disagrees with the cache");
+        ASSERT(expected == 2 || primeLookupIndexOf(&lookup, expected + 1) == -1UL);
+    }
+    ASSERT(primeLookupIndexOf(&lookup, 1) == -1UL);
+    primeLookupDestroy(&lookup);
+    primeCacheClose(&cache);
+
+    darrayDestroy(darrayLow);
+    darrayDestroy(darrayHigh);
+    darrayDestroy(darrayBasePrimes);
+    remove(path);
+    return 0;
+}
+
+int shard_test() {
+    // Slices are contiguous, cut on chunk boundaries and cover the job, even with more shards than chunks
+    ulong jobs[][3] = {{0, 2000000, 3}, {1000, 1000 + 5 * DECOMP_CHUNK_SIZE + 7, 4}, {10, 20, 3}};
+    for (ulong j = 0; j < sizeof jobs / sizeof *jobs; j++) {
+        ulong expectedFirst = jobs[j][0];
+        for (ulong i = 0; i < jobs[j][2]; i++) {
+            ShardHeader header;
+            shardRange(&header, jobs[j][0], jobs[j][1], jobs[j][2], i, DECOMP_OUTPUT_TEXT);
+            ASSERT(header.firstNumber == expectedFirst && header.lastNumber >= header.firstNumber);
+            ASSERT(header.lastNumber == jobs[j][1] || (header.lastNumber - jobs[j][0]) % DECOMP_CHUNK_SIZE == 0);
+            expectedFirst = header.lastNumber;
+        }
+        ASSERT(expectedFirst == jobs[j][1]);
+    }
+
+    const char* paths[] = {"/tmp/decomp-test-0.shard", "/tmp/decomp-test-1.shard"};
+    const char* payloads[] = {"4 = 2^2\n", "6 = 2 * 3\n8 = 2^3\n"};
+    for (ulong i = 0; i < 2; i++) {
+        ShardHeader header;
+        shardRange(&header, 0, 2 * DECOMP_CHUNK_SIZE, 2, i, DECOMP_OUTPUT_TEXT);
+        ASSERT(shardBegin(paths[i], &header));
+        int fd = open(paths[i], O_WRONLY | O_APPEND);
+        ASSERT(write(fd, payloads[i], strlen(payloads[i])) == (ssize_t)strlen(payloads[i]));
+        close(fd);
+        ASSERT(shardSeal(paths[i], &header));
+        ASSERT(header.payloadSize == strlen(payloads[i]));
+    }
+    char* reversed[] = {(char*)paths[1], (char*)paths[0]};
+    const char* mergedPath = "/tmp/decomp-test-merged.txt";
+    ASSERT(shardMerge(mergedPath, reversed, 2));
+    char merged[64] = {0};
+    int fd = open(mergedPath, O_RDONLY);
+    ASSERT(read(fd, merged, sizeof merged) == 26 && strcmp(merged, "4 = 2^2\n6 = 2 * 3\n8 = 2^3\n") == 0);
+    close(fd);
+    ASSERT_MSG(!shardMerge(NULL, reversed, 1), "a shard on its own is not the whole job");
+
+    // Any change to a payload must be caught
+    fd = open(paths[1], O_WRONLY);
+    ASSERT(pwrite(fd, "7", 1, sizeof(ShardHeader)) == 1);
+    close(fd);
+    ASSERT(!shardMerge(NULL, reversed, 2));
+
+    // With more shards than chunks, the last slice is empty, yet sealed all the same
+    for (ulong i = 0; i < 2; i++) {
+        remove(paths[i]);
+        ShardHeader header;
+        shardRange(&header, 0, 10, 2, i, DECOMP_OUTPUT_TEXT);
+        ASSERT(shardBegin(paths[i], &header));
+        ASSERT(i == 0 || header.firstNumber == header.lastNumber);
+        if (i == 0) {
+            fd = open(paths[i], O_WRONLY | O_TRUNC);
+            ASSERT(write(fd, &header, sizeof header) == sizeof header && write(fd, payloads[0], 8) == 8);
+            close(fd);
+        } else {
+            ASSERT_MSG(!shardMerge(NULL, (char**)paths, 2), "a shard that was never sealed must be refused");
+        }
+        ASSERT(shardSeal(paths[i], &header));
+    }
+    ASSERT_MSG(shardMerge(mergedPath, (char**)paths, 2), "an empty slice is a complete shard once sealed");
+    memset(merged, 0, sizeof merged);
+    fd = open(mergedPath, O_RDONLY);
+    ASSERT(read(fd, merged, sizeof merged) == 8 && strcmp(merged, payloads[0]) == 0);
+    close(fd);
+    remove(paths[0]);
+    remove(paths[1]);
+    remove(mergedPath);
+    return 0;
+}
+
+/** Runs [FIRST, LAST) of a binary job into PATH, as a shard when HEADER is not NULL. */
+static void runBinaryWindow(const char* primePath, const char* path, ulong first, ulong last, ShardHeader* header) {
+    DecompSettings settings = {
+        .firstNumber = first,
+        .lastNumber = last,
+        .primeListPath = primePath,
+        .outputPath = path,
+        .outputBase = header ? sizeof *header : 0,
+        .threadCount = 2,
+        .engine = DECOMP_TRIAL_DIVISION,
+        .output = DECOMP_OUTPUT_BINARY,
+    };
+    launchDecomposition(&settings);
+}
+
+int shard_binary_test() {
+    // Three shards of uneven length, so that the tables are rebased onto offsets that differ
+    ulong last = 2 * DECOMP_CHUNK_SIZE + 1000;
+    const char* primePath = "/tmp/decomp-test-shard-primes.bin";
+    const char* wholePath = "/tmp/decomp-test-whole.bin";
+    const char* mergedPath = "/tmp/decomp-test-merged.bin";
+    const char* paths[] = {"/tmp/decomp-test-0.shard", "/tmp/decomp-test-1.shard", "/tmp/decomp-test-2.shard"};
+    ulong* darrayBasePrimes = sieveBasePrimes(integerSqrt(last) + 1);
+    ulong* darrayPrimes = darrayCreate(64, sizeof(ulong));
+    sieveRange(darrayBasePrimes, 0, last, &darrayPrimes);
+    ASSERT(primeCacheStore(primePath, NULL, last, darrayPrimes, darrayLength(darrayPrimes)));
+    darrayDestroy(darrayPrimes);
+    darrayDestroy(darrayBasePrimes);
+
+    runBinaryWindow(primePath, wholePath, 0, last, NULL);
+    for (ulong i = 0; i < 3; i++) {
+        ShardHeader header;
+        shardRange(&header, 0, last, 3, i, DECOMP_OUTPUT_BINARY);
+        ASSERT(shardBegin(paths[i], &header));
+        runBinaryWindow(primePath, paths[i], header.firstNumber, header.lastNumber, &header);
+        ASSERT(shardSeal(paths[i], &header));
+    }
+    char* shards[] = {(char*)paths[2], (char*)paths[0], (char*)paths[1]};
+    ASSERT(shardMerge(mergedPath, shards, 3));
+
+    FactorTable whole, merged;
+    ASSERT(factorTableOpen(&whole, wholePath, primePath));
+    ASSERT(factorTableOpen(&merged, mergedPath, primePath));
+    ASSERT(merged.header->firstNumber == 0 && merged.header->lastNumber == last);
+    ulong factors[MAX_DISTINCT_FACTORS], counts[MAX_DISTINCT_FACTORS];
+    ulong expectedFactors[MAX_DISTINCT_FACTORS], expectedCounts[MAX_DISTINCT_FACTORS];
+    ulong factorCount, expectedCount;
+    for (ulong n = 0; n < last; n++) {
+        ASSERT(factorTableLookup(&whole, n, expectedFactors, expectedCounts, &expectedCount));
+        ASSERT_MSG(factorTableLookup(&merged, n, factors, counts, &factorCount), "the merged table lost a number");
+        ASSERT(factorCount == expectedCount);
+        for (ulong j = 0; j < factorCount; j++) {
+            ASSERT_MSG(factors[j] == expectedFactors[j] && counts[j] == expectedCounts[j],
+                       "the merged table disagrees with a single run");
+        }
+    }
+    ASSERT(!factorTableLookup(&merged, last, factors, counts, &factorCount));
+    ASSERT_MSG(merged.mappingSize == whole.mappingSize, "the merge should write what a single run writes");
+    factorTableClose(&whole);
+    factorTableClose(&merged);
+    for (ulong i = 0; i < 3; i++) {
+        remove(paths[i]);
+    }
+    remove(primePath);
+    remove(wholePath);
+    remove(mergedPath);
+    return 0;
+}
+
+static int countFactors(uint64_t n, const uint64_t* factors, const uint32_t* exps, size_t count, void* user) {
+    uint64_t product = 1;
+    for (size_t i = 0; i < count; i++) {
+        for (uint32_t e = 0; e < exps[i]; e++) {
+            product *= factors[i];
+        }
+    }
+    if (n >= 2 && product != n)
+        return 1;
+    *(ulong*)user += count;
+    return n == 1000 + 500 ? 2 : 0;
+}
+
+static int sumFactors(uint64_t n, const uint64_t* factors, const uint32_t* exps, size_t count, void* user) {
+    (void)n, (void)factors, (void)exps;
+    *(ulong*)user += count;
+    return 0;
+}
+
+int libdecomp_test() {
+    decomp_ctx* ctx = decomp_create(1000, NULL, 2);
+    ASSERT(ctx && decomp_prime_limit(ctx) == 1000);
+    uint64_t factors[DECOMP_MAX_FACTORS];
+    uint32_t exps[DECOMP_MAX_FACTORS];
+    ASSERT(decomp_factor(ctx, 1, factors, exps) == 0);
+    ASSERT(decomp_factor(ctx, 997, factors, exps) == 1 && factors[0] == 997 && exps[0] == 1);
+    ASSERT(decomp_factor(ctx, 360, factors, exps) == 3 && factors[2] == 5 && exps[0] == 3);
+    // Beyond the square of the table, rho takes over
+    ASSERT(decomp_factor(ctx, 1000000007UL * 998244353UL, factors, exps) == 2);
+    ASSERT(factors[0] == 998244353UL && factors[1] == 1000000007UL);
+
+    uint64_t primes[8];
+    ASSERT(decomp_primes_range(ctx, 100, 200, primes, 8) == 21 && primes[0] == 101 && primes[7] == 137);
+    ASSERT(decomp_primes_range(ctx, 1000000, 1000100, primes, 8) == 6 && primes[0] == 1000003);
+
+    ulong total = 0;
+    ASSERT(decomp_factor_range(ctx, 0, 1000, countFactors, &total) == 0);
+    ASSERT_MSG(total == 2124, "the sum of the number of distinct prime factors below 1000 is 2124");
+    ASSERT_MSG(decomp_factor_range(ctx, 1000, 2000, countFactors, &total) == 2, "the callback stops the range");
+
+    // Each worker reduces into its own total
+    ulong totals[4] = {0};
+    void* users[4] = {totals, totals + 1, totals + 2, totals + 3};
+    ASSERT(decomp_factor_stream(ctx, 0, 200000, sumFactors, users, 4) == 0);
+    ASSERT_MSG(totals[0] + totals[1] + totals[2] + totals[3] == 544994,
+               "the sum of the number of distinct prime factors below 200000 is 544994");
+    ASSERT(decomp_factor_stream(ctx, 1000, 200000, countFactors, users, 4) == 2);
+    decomp_destroy(ctx);
+    return 0;
+}
+
+int stats_test() {
+    statsInit(2);
+    // Three numbers in [256, 512) and one in [4096, 8192), from two workers
+    statsAddLatency(statsSlot(0), 300);
+    statsAddLatency(statsSlot(0), 511);
+    statsAddLatency(statsSlot(1), 256);
+    statsAddLatency(statsSlot(1), 5000);
+    statsAdd(statsSlot(1), STATS_FACTORIZE, 6067, 4);
+    StatsTimer timer;
+    statsBegin(&timer);
+    statsEnd(STATS_WRITER_THREAD, STATS_IO, &timer);
+    ASSERT(statsSlot(STATS_WRITER_THREAD)->units[STATS_IO] == 1 && statsSlot(0)->histogram[8] == 2);
+
+    const char* path = "/tmp/decomp-test-stats.json";
+    ASSERT(statsWriteJson(path));
+    char json[4096] = {0};
+    FILE* file = fopen(path, "r");
+    ASSERT(file && fread(json, 1, sizeof json - 1, file) > 0);
+    fclose(file);
+    ASSERT(strstr(json, "\"count\": 4,") && strstr(json, "\"p50\": 512,") && strstr(json, "\"max\": 8192,"));
+    ASSERT(strstr(json, "\"factorize\": {\"seconds\": ") && strstr(json, "\"cycles\": 6067, \"units\": 4}"));
+    ASSERT_MSG(strstr(json, "{\"low\": 4096, \"high\": 8192, \"count\": 1}"),
+               "the slow number has a bucket of its own");
+    statsShutdown();
+    remove(path);
+    return 0;
+}
+
+int perf_test() {
+    perfInit(1);
+    PerfCounters counters;
+    perfBegin(&counters);
+    volatile ulong sum = 0;
+    for (ulong i = 0; i < 1000000; i++) {
+        sum += i;
+    }
+    perfEnd(&counters, STATS_MAIN_THREAD, STATS_CACHE_WRITE);
+    // Whatever the machine lets us count, the phase and the thread that measured it are reported
+    FILE* file = tmpfile();
+    perfPrint(file);
+    char report[8192] = {0};
+    rewind(file);
+    ASSERT(fread(report, 1, sizeof report - 1, file) > 0);
+    fclose(file);
+    ASSERT(strstr(report, "cache_write") && strstr(report, "\n    main ") && !strstr(report, "factorize"));
+    perfShutdown();
+    return 0;
+}
+
+int trace_test() {
+    traceInit(1);
+    ulong start = traceNow();
+    traceRecord(0, TRACE_DECOMPOSE_CHUNK, start, 0, 4096);
+    // Past its capacity, the ring of the writer keeps its latest events only
+    for (ulong i = 0; i < TRACE_BUFFER_EVENTS + 10; i++) {
+        traceRecord(STATS_WRITER_THREAD, TRACE_FLUSH, traceNow(), i, 100);
+    }
+    const char* path = "/tmp/decomp-test-trace.json";
+    ASSERT(traceWrite(path));
+    traceShutdown();
+
+    FILE* file = fopen(path, "r");
+    ASSERT(file);
+    char line[256];
+    ulong flushes = 0;
+    bool chunk = FALSE, oldest = FALSE, latest = FALSE;
+    while (fgets(line, sizeof line, file)) {
+        flushes += strstr(line, "\"name\": \"flush\"") != NULL;
+        chunk |= strstr(line, "\"tid\": 0, ") && strstr(line, "\"args\": {\"first\": 0, \"last\": 4096}}");
+        oldest |= strstr(line, "\"sequence\": 9, ") != NULL;
+        latest |= strstr(line, "\"sequence\": 65545, \"bytes\": 100}") != NULL;
+    }
+    fclose(file);
+    remove(path);
+    ASSERT(flushes == TRACE_BUFFER_EVENTS && chunk && latest);
+    ASSERT_MSG(!oldest, "the oldest events were overwritten");
+    return 0;
+}
@@ -1,4 +1,9 @@
 #pragma once
 #include "defines.h"
 
+// Numbers a worker takes from the queue at once, each chunk is written out as a whole
+#define DECOMP_CHUNK_SIZE (1 << 14)
+// Chunks each worker can have waiting for the writer before it blocks
+#define DECOMP_WINDOW_PER_THREAD 4
+
 void launchDecomposition(const ulong *primes, size_t primeCount, size_t tableSize, const char *filePath, size_t threadCount);
@@ -0,0 +1,38 @@
+#pragma once
+#include "defines.h"
+
+#include <pthread.h>
+
+typedef struct {
+    int fd;
+    char* data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+typedef struct {
+    OutputBuffer buffer;
+    bool ready;
+} OutputChunk;
+
+typedef struct {
+    int fd;
+    ulong chunkCount;
+    ulong windowSize;
+    OutputChunk* slots;
+    ulong nextToWrite;
+    pthread_mutex_t mutex;
+    pthread_cond_t chunkReady;
+    pthread_cond_t slotFree;
+    pthread_t writerThread;
+} OrderedWriter;
+
+void outputBufferReserve(OutputBuffer* buffer, size_t size);
+
+void orderedWriterStart(OrderedWriter* writer, int fd, ulong chunkCount, ulong windowSize);
+
+void orderedWriterFinish(OrderedWriter* writer);
+
+OutputChunk* orderedWriterAcquire(OrderedWriter* writer, ulong sequence);
+
+void orderedWriterSubmit(OrderedWriter* writer, ulong sequence);
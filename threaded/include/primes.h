@@ -2,3 +2,5 @@
 #include "defines.h"
 
 ulong findPrimes(ulong *primes, size_t limit, size_t threadCount);
+
+ulong exactPrimeCount(ulong x);
@@ -9,6 +9,7 @@ void startProgressReport(ulong max);
 void stopProgressReport();
 
 void registerProgress(ulong threadId);
+void registerProgressAmount(ulong threadId, ulong amount);
 
 void initProgressReporter(size_t threadCount);
 void shutdownProgressReporter();
@@ -1,12 +1,30 @@
 #include "decomposition.h"
+#include "ordered-output.h"
 #include "progress.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <err.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
 
-static pthread_mutex_t fileMutex;
+// A 20-digit number followed by at most 15 factors of the form " * p^e"
+#define LINE_MAX_LENGTH 1024
+
+static const char digitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
 
 static ulong sqr(ulong num) { return num * num; }
 
@@ -45,7 +63,11 @@ static ulong decomposeSingle(const ulong *primes, ulong *factors, size_t primeCo
     }
     if (number > 1) {
         ulong index = indexOfPrime(primes, primeCount, number);
-        if (index != -1) {
+        if (index == j) {
+            // What remains is the prime that was just divided out, as in 4 = 2^2
+            factors[index]++;
+            greatestFactorIndex = index;
+        } else if (index != -1) {
             for (size_t i = j + 1; i < index; i++) {
                 factors[i] = 0;
             }
@@ -58,78 +80,108 @@ static ulong decomposeSingle(const ulong *primes, ulong *factors, size_t primeCo
     return greatestFactorIndex;
 }
 
-static void writeFactorsToFile(const ulong *primes, const ulong *factors, size_t primeCount, ulong number, ulong maxFactorIndex, FILE* file) {
-    pthread_mutex_lock(&fileMutex);
+/** Writes the decimal digits of VALUE at OUT, two digits per division. */
+static char* formatUnsigned(char* out, ulong value) {
+    char digits[20];
+    char* end = digits + sizeof digits;
+    char* start = end;
+    while (value >= 100) {
+        ulong quotient = value / 100;
+        start -= 2;
+        memcpy(start, digitPairs + 2 * (value - quotient * 100), 2);
+        value = quotient;
+    }
+    if (value >= 10) {
+        start -= 2;
+        memcpy(start, digitPairs + 2 * value, 2);
+    } else {
+        *--start = '0' + value;
+    }
+    memcpy(out, start, end - start);
+    return out + (end - start);
+}
+
+/** Formats the line into the buffer of the chunk at hand, which the writer thread puts in the file in order. */
+static void writeFactorsToFile(const ulong *primes, const ulong *factors, size_t primeCount, ulong number, ulong maxFactorIndex, OutputBuffer* buffer) {
+    outputBufferReserve(buffer, LINE_MAX_LENGTH);
+    char* out = buffer->data + buffer->length;
     bool first = TRUE;
-    fprintf(file, "%zu", number);
+    out = formatUnsigned(out, number);
     for (ulong j = 0; j <= maxFactorIndex; j++) {
         ulong p = primes[j];
         ulong c = factors[j];
         if (c > 0) {
-            if (first) {
-                fprintf(file, "%s", " = ");
-                first = FALSE;
-            } else {
-                fprintf(file, "%s", " * ");
-            }
-            fprintf(file, "%zu", p);
+            memcpy(out, first ? " = " : " * ", 3);
+            out += 3;
+            first = FALSE;
+            out = formatUnsigned(out, p);
             if (c > 1) {
-                fprintf(file, "^%zu", c);
+                *out++ = '^';
+                out = formatUnsigned(out, c);
             }
         }
-        // fprintf(csvFile, ",%zu", c);
     }
-    fprintf(file, "%s", "\n");
-    pthread_mutex_unlock(&fileMutex);
+    *out++ = '\n';
+    buffer->length = out - buffer->data;
 }
 
 typedef struct {
-    ulong firstNumber;
-    ulong lastNumber;
     const ulong* primes;
     size_t primeCount;
     size_t tableSize;
-    FILE* file;
+    ulong chunkCount;
+    OrderedWriter* writer;
+    // The chunk queue, shared by every worker
+    atomic_ulong* nextChunk;
     ulong threadId;
 } DecompData;
 
+/** Takes chunks from the queue until there are none left, whichever thread is faster takes more of them. */
 static void* decompose(void *input) {
     DecompData* data = (DecompData*)input;
     //ulong factors[data->primeCount];
     ulong* factors = malloc(sizeof *factors * data->primeCount);
-    for (ulong i = data->firstNumber; i < data->lastNumber; i++) {
-        //clearArray(factors, primeCount);
-        ulong maxFactorIndex = decomposeSingle(data->primes, factors, data->primeCount, i);
-        //Saving to file
-        writeFactorsToFile(data->primes, factors, data->primeCount, i, maxFactorIndex, data->file);
-        registerProgress(data->threadId);
+    ulong sequence;
+    while ((sequence = atomic_fetch_add_explicit(data->nextChunk, 1, memory_order_relaxed)) < data->chunkCount) {
+        ulong first = sequence * DECOMP_CHUNK_SIZE;
+        ulong last = first + DECOMP_CHUNK_SIZE < data->tableSize ? first + DECOMP_CHUNK_SIZE : data->tableSize;
+        OutputChunk* chunk = orderedWriterAcquire(data->writer, sequence);
+        for (ulong i = first; i < last; i++) {
+            //clearArray(factors, primeCount);
+            ulong maxFactorIndex = decomposeSingle(data->primes, factors, data->primeCount, i);
+            //Saving to file
+            writeFactorsToFile(data->primes, factors, data->primeCount, i, maxFactorIndex, &chunk->buffer);
+            registerProgress(data->threadId);
+        }
+        orderedWriterSubmit(data->writer, sequence);
     }
     free(factors);
     return NULL;
 }
 
+/** Decomposes every number below TABLESIZE into FILEPATH, in order whatever the thread count.
+ *  Workers format chunks of DECOMP_CHUNK_SIZE numbers, and a writer thread puts them in the file one after the other.
+ */
 void launchDecomposition(const ulong *primes, size_t primeCount, size_t tableSize, const char *filePath, size_t threadCount) {
-    pthread_mutex_init(&fileMutex, NULL);
     startProgressReport(tableSize - 1);
-    size_t perThread = tableSize / threadCount;
-    size_t surplus = tableSize % threadCount;
     DecompData threadInputs[threadCount];
     pthread_t threads[threadCount];
-    ulong previousLastNumber = 0;
-    FILE* file = fopen(filePath, "w");
+    int file = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+        err(5, "Could not open output file %s", filePath);
+    ulong chunkCount = (tableSize + DECOMP_CHUNK_SIZE - 1) / DECOMP_CHUNK_SIZE;
+    OrderedWriter writer;
+    orderedWriterStart(&writer, file, chunkCount, DECOMP_WINDOW_PER_THREAD * threadCount);
+    atomic_ulong nextChunk;
+    atomic_init(&nextChunk, 0);
     for (size_t i = 0; i < threadCount; i++) {
         DecompData* input = threadInputs + i;
-        input->firstNumber = previousLastNumber;
-        input->lastNumber = previousLastNumber + perThread;
-        if (surplus > 0) {
-            input->lastNumber++;
-            surplus--;
-        }
-        previousLastNumber = input->lastNumber;
-        input->file = file;
         input->primeCount = primeCount;
         input->primes = primes;
         input->tableSize = tableSize;
+        input->chunkCount = chunkCount;
+        input->writer = &writer;
+        input->nextChunk = &nextChunk;
         input->threadId = i;
         pthread_create(&threads[i], NULL, decompose, input);
     }
@@ -137,7 +189,7 @@ void launchDecomposition(const ulong *primes, size_t primeCount, size_t tableSiz
     for (size_t i = 0; i < threadCount; i++) {
         pthread_join(threads[i], NULL);
     }
-    fclose(file);
-    pthread_mutex_destroy(&fileMutex);
+    orderedWriterFinish(&writer);
+    close(file);
     stopProgressReport();
 }
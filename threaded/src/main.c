@@ -84,12 +84,10 @@ int main(int argc, char **argv) {
     initProgressReporter(threadCount);
 
     FILE* file = fopen("primes.txt", "w");
-    ulong maxPrimeCount = limit;
-    ulong* primes = malloc(sizeof *primes * maxPrimeCount);
+    ulong maxPrimeCount = limit > 2 ? exactPrimeCount(limit - 1) : 0;
+    ulong* primes = malloc(sizeof *primes * (maxPrimeCount + 1));
     printf("Counting primes, %zu worker threads...\n", threadCount);
-    ulong primeCount = findPrimes(primes, maxPrimeCount, threadCount);
-    //Trimming the array to save memory
-    primes = realloc(primes, primeCount * sizeof *primes);
+    ulong primeCount = findPrimes(primes, limit, threadCount);
     printf("\nFound %zu prime numbers.\n", primeCount);
     for (ulong i = 0; i < primeCount; i++) {
         fprintf(file, "%zu\n", primes[i]);
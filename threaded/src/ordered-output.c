@@ -0,0 +1,115 @@
+#include "ordered-output.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Initial size of a chunk buffer, they grow as needed and are reused afterwards
+#define CHUNK_BUFFER_SIZE (1 << 16)
+
+/** Makes room for SIZE more bytes in BUFFER, growing it if needed. */
+void outputBufferReserve(OutputBuffer* buffer, size_t size) {
+    if (buffer->length + size <= buffer->capacity)
+        return;
+    while (buffer->length + size > buffer->capacity) {
+        buffer->capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, buffer->capacity);
+    if (!buffer->data)
+        err(19, "Could not grow output buffer to %zu bytes", buffer->capacity);
+}
+
+static void outputBufferFlush(OutputBuffer* buffer) {
+    size_t written = 0;
+    while (written < buffer->length) {
+        ssize_t result = write(buffer->fd, buffer->data + written, buffer->length - written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            err(6, "Could not write output");
+        }
+        written += result;
+    }
+    buffer->length = 0;
+}
+
+/** Writes the chunks out strictly in sequence order.
+ *  The lock is only held to look at the slots, never while writing.
+ */
+static void* runWriter(void* input) {
+    OrderedWriter* writer = input;
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->nextToWrite < writer->chunkCount) {
+        OutputChunk* chunk = writer->slots + writer->nextToWrite % writer->windowSize;
+        while (!chunk->ready) {
+            pthread_cond_wait(&writer->chunkReady, &writer->mutex);
+        }
+        pthread_mutex_unlock(&writer->mutex);
+
+        outputBufferFlush(&chunk->buffer);
+
+        pthread_mutex_lock(&writer->mutex);
+        chunk->ready = FALSE;
+        writer->nextToWrite++;
+        pthread_cond_broadcast(&writer->slotFree);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+/** Starts the writer thread for the chunks numbered from 0 up to CHUNKCOUNT.
+ *  At most WINDOWSIZE chunks can be in flight past the last one written,
+ *  which bounds the memory used to reorder them.
+ */
+void orderedWriterStart(OrderedWriter* writer, int fd, ulong chunkCount, ulong windowSize) {
+    writer->fd = fd;
+    writer->chunkCount = chunkCount;
+    writer->windowSize = windowSize;
+    writer->nextToWrite = 0;
+    writer->slots = malloc(sizeof *writer->slots * windowSize);
+    for (ulong i = 0; i < windowSize; i++) {
+        OutputBuffer* buffer = &writer->slots[i].buffer;
+        buffer->fd = fd;
+        buffer->data = malloc(CHUNK_BUFFER_SIZE);
+        buffer->length = 0;
+        buffer->capacity = CHUNK_BUFFER_SIZE;
+        writer->slots[i].ready = FALSE;
+    }
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->chunkReady, NULL);
+    pthread_cond_init(&writer->slotFree, NULL);
+    pthread_create(&writer->writerThread, NULL, runWriter, writer);
+}
+
+/** Waits for every chunk to be written and releases the writer. */
+void orderedWriterFinish(OrderedWriter* writer) {
+    pthread_join(writer->writerThread, NULL);
+    for (ulong i = 0; i < writer->windowSize; i++) {
+        free(writer->slots[i].buffer.data);
+    }
+    free(writer->slots);
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->chunkReady);
+    pthread_cond_destroy(&writer->slotFree);
+}
+
+/** Returns the empty buffer chunk SEQUENCE must be formatted into.
+ *  Only blocks when SEQUENCE is a whole window ahead of the writer.
+ */
+OutputChunk* orderedWriterAcquire(OrderedWriter* writer, ulong sequence) {
+    pthread_mutex_lock(&writer->mutex);
+    while (sequence >= writer->nextToWrite + writer->windowSize) {
+        pthread_cond_wait(&writer->slotFree, &writer->mutex);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return &writer->slots[sequence % writer->windowSize];
+}
+
+void orderedWriterSubmit(OrderedWriter* writer, ulong sequence) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->slots[sequence % writer->windowSize].ready = TRUE;
+    if (sequence == writer->nextToWrite)
+        pthread_cond_signal(&writer->chunkReady);
+    pthread_mutex_unlock(&writer->mutex);
+}
@@ -2,13 +2,22 @@
 #include "progress.h"
 
 #include <pthread.h>
+#include <string.h>
+
+// Bytes of sieve per segment, one byte per odd number
+#define SEGMENT_SIZE (1 << 15)
+#define SEGMENT_SPAN (2 * (ulong)SEGMENT_SIZE)
 
 static ulong sqr(ulong num) { return num * num; }
 
 static ulong isqrt(ulong num) {
+    if (num < 2)
+        return num;
     ulong x = num >> 1;
-    for (uint i = 0; i < ISQRT_STEPS; i++) {
-        x = (x + (num / x)) >> 1;
+    ulong y = (x + num / x) >> 1;
+    while (y < x) {
+        x = y;
+        y = (x + num / x) >> 1;
     }
     return x;
 }
@@ -18,31 +27,70 @@ typedef struct {
     ulong lastNumber;
     ulong outPrimeCount;
     ulong* primes;
+    const ulong* basePrimes;
+    ulong basePrimeCount;
     ulong threadId;
 } PrimeData;
 
+static ulong sieveBasePrimes(ulong* basePrimes, ulong limit) {
+    ulong count = 0;
+    bool* composite = calloc(limit + 1, sizeof *composite);
+    for (ulong i = 2; i <= limit; i++) {
+        if (composite[i])
+            continue;
+        basePrimes[count++] = i;
+        for (ulong j = i * i; j <= limit; j += i) {
+            composite[j] = TRUE;
+        }
+    }
+    free(composite);
+    return count;
+}
+
+static ulong sieveSegment(PrimeData* data, bool* segment, ulong low, ulong high, ulong index) {
+    if (low <= 2 && high > 2)
+        data->primes[index++] = 2;
+    ulong first = low < 3 ? 3 : low | 1;
+    if (first >= high)
+        return index;
+    ulong length = (high - first + 1) / 2;
+    memset(segment, 0, length);
+    for (ulong j = 1; j < data->basePrimeCount && sqr(data->basePrimes[j]) < high; j++) {
+        ulong p = data->basePrimes[j];
+        ulong multiple = sqr(p);
+        if (multiple < first) {
+            multiple = (first + p - 1) / p * p;
+            if ((multiple & 1) == 0)
+                multiple += p;
+        }
+        for (ulong k = (multiple - first) / 2; k < length; k += p) {
+            segment[k] = TRUE;
+        }
+    }
+    for (ulong k = 0; k < length; k++) {
+        if (!segment[k])
+            data->primes[index++] = first + 2 * k;
+    }
+    return index;
+}
+
 static void *threadedFindPrimes(void *input) {
     PrimeData* data = input;
+    bool* segment = malloc(SEGMENT_SIZE);
     ulong index = 0;
-    for (ulong i = data->firstNumber; i < data->lastNumber; i++) {
-        bool isPrime = TRUE;
-        for (ulong j = 0; j < index && sqr(data->primes[j]) <= i; j++) {
-            if (i % data->primes[j] == 0) {
-                isPrime = FALSE;
-                break;
-            }
-        }
-        if (isPrime) {
-            data->primes[index] = i;
-            index++;
-        }
-        //printBar(i, limit - 1, 30);
-        registerProgress(data->threadId);
+    for (ulong low = data->firstNumber; low < data->lastNumber; low += SEGMENT_SPAN) {
+        ulong high = data->lastNumber - low > SEGMENT_SPAN ? low + SEGMENT_SPAN : data->lastNumber;
+        index = sieveSegment(data, segment, low, high, index);
+        registerProgressAmount(data->threadId, high - low);
     }
+    free(segment);
     data->outPrimeCount = index;
+    return NULL;
 }
 
 ulong findPrimes(ulong *primes, size_t limit, size_t threadCount) {
+    if (limit <= 2)
+        return 0;
     size_t iterCount = limit - 2;
     startProgressReport(iterCount);
     size_t perThread = iterCount / threadCount;
@@ -51,9 +99,11 @@ ulong findPrimes(ulong *primes, size_t limit, size_t threadCount) {
     pthread_t threads[threadCount];
     ulong previousLastNumber = 2;
     ulong* resultTables[threadCount];
-    for (size_t i = 0; i < threadCount; i++) {
-        resultTables[i] = calloc(limit / threadCount, sizeof **resultTables);
-    }
+
+    ulong baseLimit = isqrt(limit - 1);
+    ulong* basePrimes = malloc(sizeof *basePrimes * (baseLimit + 1));
+    ulong basePrimeCount = sieveBasePrimes(basePrimes, baseLimit);
+
     for (size_t i = 0; i < threadCount; i++) {
         PrimeData* input = threadInputs + i;
         input->firstNumber = previousLastNumber;
@@ -63,7 +113,10 @@ ulong findPrimes(ulong *primes, size_t limit, size_t threadCount) {
             surplus--;
         }
         previousLastNumber = input->lastNumber;
+        resultTables[i] = malloc(sizeof **resultTables * ((input->lastNumber - input->firstNumber) / 2 + 2));
         input->primes = resultTables[i];
+        input->basePrimes = basePrimes;
+        input->basePrimeCount = basePrimeCount;
         input->threadId = i;
         pthread_create(&threads[i], NULL, threadedFindPrimes, input);
     }
@@ -80,5 +133,41 @@ ulong findPrimes(ulong *primes, size_t limit, size_t threadCount) {
         free(resultTables[i]);
         primeCount += threadInputs[i].outPrimeCount;
     }
+    free(basePrimes);
     return primeCount;
 }
+
+/** Counts the primes up to X with Lucy_Hedgehog's method, to size the prime table exactly. */
+ulong exactPrimeCount(ulong x) {
+    if (x < 2)
+        return 0;
+    ulong root = isqrt(x);
+    ulong* small = malloc(sizeof *small * (root + 1)); // small[v] = S(v)
+    ulong* large = malloc(sizeof *large * (root + 1)); // large[i] = S(x / i)
+    small[0] = 0;
+    for (ulong v = 1; v <= root; v++) {
+        small[v] = v - 1;
+    }
+    for (ulong i = 1; i <= root; i++) {
+        large[i] = x / i - 1;
+    }
+    for (ulong p = 2; p <= root; p++) {
+        if (small[p] == small[p - 1])
+            continue;
+        ulong primesBelow = small[p - 1];
+        ulong square = p * p;
+        ulong end = x / square < root ? x / square : root;
+        for (ulong i = 1; i <= end; i++) {
+            ulong d = i * p;
+            ulong sieved = d <= root ? large[d] : small[x / d];
+            large[i] -= sieved - primesBelow;
+        }
+        for (ulong v = root; v >= square; v--) {
+            small[v] -= small[v / p] - primesBelow;
+        }
+    }
+    ulong count = large[1];
+    free(small);
+    free(large);
+    return count;
+}
@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 static ulong maxProgress = 0;
@@ -79,16 +80,22 @@ static void printProgress(bool lastPrint) {
 }
 
 void startProgressReport(ulong max) {
+    pthread_mutex_lock(&reportMutex);
     maxProgress = max;
     clearArray(progress, s_threadCount);
     clearArray(iterations, s_threadCount);
     threadStatus = 1;
     pthread_cond_signal(&reportCondition);
+    pthread_mutex_unlock(&reportMutex);
 }
 
 void stopProgressReport() {
+    pthread_mutex_lock(&reportMutex);
     threadStatus = 0;
+    // Wakes the reporter up, so that the program does not wait out its refresh interval when it ends
+    pthread_cond_signal(&reportCondition);
     printProgress(TRUE);
+    pthread_mutex_unlock(&reportMutex);
 }
 
 void registerProgress(ulong threadId) {
@@ -96,6 +103,21 @@ void registerProgress(ulong threadId) {
     progress[threadId]++;
 }
 
+void registerProgressAmount(ulong threadId, ulong amount) {
+    iterations[threadId] += amount;
+    progress[threadId] += amount;
+}
+
+/** Waits a second before the next print, or less if the report is stopped meanwhile.
+ *  Called with the report mutex held, which is released while waiting.
+ */
+static void waitForRefresh() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&reportCondition, &reportMutex, &deadline);
+}
+
 static void *reportProgress(void *ptr) {
     pthread_mutex_lock(&reportMutex);
     while(threadStatus != 2) {
@@ -103,7 +125,7 @@ static void *reportProgress(void *ptr) {
         while (threadStatus == 1) {
             printProgress(FALSE);
             clearArray(iterations, s_threadCount);
-            sleep(1);
+            waitForRefresh();
         }
     }
     pthread_mutex_unlock(&reportMutex);
@@ -120,8 +142,10 @@ void initProgressReporter(size_t threadCount) {
 }
 
 void shutdownProgressReporter() {
+    pthread_mutex_lock(&reportMutex);
     threadStatus = 2;
     pthread_cond_broadcast(&reportCondition);
+    pthread_mutex_unlock(&reportMutex);
     pthread_join(reportThread, NULL);
     pthread_mutex_destroy(&reportMutex);
     pthread_cond_destroy(&reportCondition);